@@ -1,51 +1,89 @@
 #include <iostream>
-#include <map>
 #include <vector>
-#include <sstream>
 #include <cmath>
 #include <stack>
 #include <fstream>
+#include <algorithm>
+#include <memory>
+#include <cstring>
+#include <cstdlib>
+#include <new>
+#include <array>
+#include <variant>
+#include <random>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <deque>
+#include <string_view>
+#include <charconv>
+#include <unordered_map>
+#include <cstdio>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 
 using namespace std;
-const int BOARD_WIDTH = 80;
-const int BOARD_HEIGHT = 25;
+const int DEFAULT_BOARD_WIDTH = 80;
+const int DEFAULT_BOARD_HEIGHT = 25;
+const size_t CACHE_LINE = 64;
 
 enum FillOption { FILL, FRAME };
 
-struct Color {
-    map<string, pair<string, char> > colors = {
-        {"red", {"\033[31m", 'R'}},
-        {"green", {"\033[32m", 'G'}},
-        {"yellow", {"\033[33m", 'Y'}},
-        {"blue", {"\033[34m", 'B'}},
-        {"magenta", {"\033[35m", 'M'}},
-        {"cyan", {"\033[36m", 'C'}},
-        {"white", {"\033[37m", 'W'}}
-    };
+// Colour IDs index PALETTE; a shape keeps only its ID. NO_COLOR covers every name
+// that is not in the palette.
+enum ColorId : unsigned char { NO_COLOR, RED, GREEN, YELLOW, BLUE, MAGENTA, CYAN, WHITE, PALETTE_SIZE };
 
-    string reset = "\033[0m";
+struct PaletteEntry {
+    const char *name;
+    const char *code;
+    char symbol;
+};
 
-    string getColorCode(const string &color) const {
-        if (colors.find(color) != colors.end()) {
-            return colors.at(color).first;
-        }
-        return reset;
-    }
+constexpr PaletteEntry PALETTE[PALETTE_SIZE] = {
+    {"none", "\033[0m", '*'},
+    {"red", "\033[31m", 'R'},
+    {"green", "\033[32m", 'G'},
+    {"yellow", "\033[33m", 'Y'},
+    {"blue", "\033[34m", 'B'},
+    {"magenta", "\033[35m", 'M'},
+    {"cyan", "\033[36m", 'C'},
+    {"white", "\033[37m", 'W'}
+};
 
-    string setColor(const string &color, char symbol) const {
-        return getColorCode(color) + symbol + reset;
+// The low five bits of the first letter tell every palette name apart, so a name is
+// looked up with one table index and one compare.
+constexpr array<unsigned char, 32> COLOR_BY_INITIAL = [] {
+    array<unsigned char, 32> table{};
+    for (int id = NO_COLOR; id < PALETTE_SIZE; ++id) {
+        table[PALETTE[id].name[0] & 31] = static_cast<unsigned char>(id);
     }
+    return table;
+}();
 
-    char getSymbol(const string &color) const {
-        for (const auto &c: colors) {
-            if (c.first == color) {
-                return c.second.second;
-            }
+static_assert([] {
+    for (int id = NO_COLOR; id < PALETTE_SIZE; ++id) {
+        if (COLOR_BY_INITIAL[PALETTE[id].name[0] & 31] != id) {
+            return false;
         }
-        return '*';
     }
-};
+    return true;
+}(), "Two palette names share a first letter.");
+
+ColorId colorIdOf(string_view name) {
+    if (name.empty()) {
+        return NO_COLOR;
+    }
+    ColorId id = static_cast<ColorId>(COLOR_BY_INITIAL[name[0] & 31]);
+    return name == PALETTE[id].name ? id : NO_COLOR;
+}
 
 
 string fillOptionType(FillOption fillOption) {
@@ -60,553 +98,2327 @@ string fillOptionType(FillOption fillOption) {
 }
 
 
-struct Board {
-    vector<vector<char> > grid;
-    Color colors;
-
-    Board() : grid(BOARD_HEIGHT, vector<char>(BOARD_WIDTH, ' ')) {
-    }
-
-    string setColorBasedOnSymbol(char symbol) {
-        switch (symbol) {
-            case 'R':
-                return colors.setColor("red", 'R');
-            case 'G':
-                return colors.setColor("green", 'G');
-            case 'B':
-                return colors.setColor("blue", 'B');
-            case 'Y':
-                return colors.setColor("yellow", 'Y');
-            case 'M':
-                return colors.setColor("magenta", 'M');
-            case 'C':
-                return colors.setColor("cyan", 'C');
-            case 'W':
-                return colors.setColor("white", 'W');
-            case ' ':
-                return string(1, ' ');
-            default:
-                return colors.setColor("white", symbol);
-        }
-    }
-
-    void print() {
-        for (auto &row: grid) {
-            for (char c: row) {
-                string coloredSymbol = setColorBasedOnSymbol(c);
-                cout << coloredSymbol;
-            }
-            cout << "\n";
-        }
-    }
+// Words the command, add and load paths recognise. Like colour names, each is found
+// with one table index and one compare.
+enum class Keyword : unsigned char {
+    NONE, DRAW, LIST, SHAPES, ADD, UNDO, CLEAR, SAVE, LOAD, SELECT, REMOVE, PAINT, BENCH, THREADS, STATS, PICK,
+    MOVE, EDIT, STOP, RECTANGLE, CIRCLE, TRIANGLE, LINE, FILL, FRAME, COUNT
+};
 
-    void clear() {
-        for (auto &row: grid) {
-            for (char &c: row) {
-                c = ' ';
-            }
-        }
-    }
+constexpr string_view KEYWORDS[static_cast<int>(Keyword::COUNT)] = {
+    "", "draw", "list", "shapes", "add", "undo", "clear", "save", "load", "select", "remove", "paint", "bench",
+    "threads", "stats", "pick", "move", "edit", "stop", "rectangle", "circle", "triangle", "line", "fill", "frame"
 };
 
-class Shape {
-protected:
-    string color;
-    char colorSymbol;
-    Color colors;
+// The low five bits of the first and last letters, plus the length, tell every keyword
+// apart. They ignore case, so case-insensitive lookups hash the same way.
+constexpr size_t keywordHash(string_view word) {
+    return ((word.front() & 31) + (word.back() & 31) * 29 + word.size()) % 64;
+}
 
-public:
-    string getColor() const {
-        return color;
+constexpr array<Keyword, 64> KEYWORD_BY_HASH = [] {
+    array<Keyword, 64> table{};
+    for (int id = 1; id < static_cast<int>(Keyword::COUNT); ++id) {
+        table[keywordHash(KEYWORDS[id])] = static_cast<Keyword>(id);
     }
+    return table;
+}();
 
-    void setColor(const string &c) {
-        color = c;
-        colorSymbol = colors.getSymbol(c);
+static_assert([] {
+    for (int id = 1; id < static_cast<int>(Keyword::COUNT); ++id) {
+        if (KEYWORD_BY_HASH[keywordHash(KEYWORDS[id])] != static_cast<Keyword>(id)) {
+            return false;
+        }
     }
+    return true;
+}(), "Two keywords share a hash slot.");
 
-    char getColorSymbol() const {
-        return colorSymbol;
+bool equalsIgnoringCase(string_view a, string_view b) {
+    if (a.size() != b.size()) {
+        return false;
     }
+    for (size_t i = 0; i < a.size(); ++i) {
+        char c = a[i] >= 'A' && a[i] <= 'Z' ? static_cast<char>(a[i] + 32) : a[i];
+        char d = b[i] >= 'A' && b[i] <= 'Z' ? static_cast<char>(b[i] + 32) : b[i];
+        if (c != d) {
+            return false;
+        }
+    }
+    return true;
+}
 
+Keyword keywordOf(string_view word, bool ignoreCase = false) {
+    if (word.empty()) {
+        return Keyword::NONE;
+    }
+    Keyword id = KEYWORD_BY_HASH[keywordHash(word)];
+    const string_view &keyword = KEYWORDS[static_cast<int>(id)];
+    return (ignoreCase ? equalsIgnoringCase(word, keyword) : word == keyword) ? id : Keyword::NONE;
+}
 
-    virtual void draw(vector<vector<char> > &grid) = 0;
-
-    virtual void print() const = 0;
+// Splits a line into whitespace-separated tokens without copying it, so the line must
+// outlive the views it hands out. Reads behave like istream's >>: numbers are decimal
+// with an optional sign and stop at the first character that is not a digit.
+class Tokenizer {
+private:
+    string_view rest;
 
-    virtual string getType() const = 0;
+    static bool isSpace(char c) {
+        return c == ' ' || (c >= '\t' && c <= '\r');
+    }
 
-    virtual string getParams() const = 0;
+    void skipSpaces() {
+        size_t start = 0;
+        while (start < rest.size() && isSpace(rest[start])) {
+            ++start;
+        }
+        rest.remove_prefix(start);
+    }
 
-    virtual bool validBorder() const = 0;
+public:
+    explicit Tokenizer(string_view line) : rest(line) {
+    }
 
-    virtual int getX() const { return 0; }
-    virtual int getY() const { return 0; }
+    // The next token, or an empty view once the line is used up.
+    string_view next() {
+        skipSpaces();
+        size_t end = 0;
+        while (end < rest.size() && !isSpace(rest[end])) {
+            ++end;
+        }
+        string_view token = rest.substr(0, end);
+        rest.remove_prefix(end);
+        return token;
+    }
 
-    virtual void setX(int x) {
+    // Leaves value and the line untouched when no number comes next.
+    bool next(int &value) {
+        skipSpaces();
+        const char *first = rest.data();
+        const char *last = first + rest.size();
+        if (last - first > 1 && *first == '+' && first[1] >= '0' && first[1] <= '9') {
+            ++first;
+        }
+        auto [end, error] = from_chars(first, last, value);
+        if (error != errc()) {
+            return false;
+        }
+        rest.remove_prefix(end - rest.data());
+        return true;
     }
 
-    virtual void setY(int y) {
+    bool next(char &value) {
+        skipSpaces();
+        if (rest.empty()) {
+            return false;
+        }
+        value = rest.front();
+        rest.remove_prefix(1);
+        return true;
     }
 
-    virtual bool coordinateContains(int cx, int cy) const = 0;
+    // Everything before the first delimiter, which is left unread; the whole rest of
+    // the line when there is none.
+    string_view until(char delimiter) {
+        string_view part = rest.substr(0, rest.find(delimiter));
+        rest.remove_prefix(part.size());
+        return part;
+    }
 
-    virtual ~Shape() {
-    };
+    bool empty() {
+        skipSpaces();
+        return rest.empty();
+    }
 };
 
+// Inclusive cell rectangle. Coordinates are wide so shapes near the int limits
+// cannot overflow their own extent.
+struct Bounds {
+    long long left, top, right, bottom;
 
-class Rectangle : public Shape {
-private:
-    int x, y, height, width;
-    FillOption fillOption;
+    bool empty() const {
+        return left > right || top > bottom;
+    }
 
-public:
-    Rectangle(int x, int y, int height, int width, FillOption fillOption, const string &colorName)
-        : x(x), y(y), height(height), width(width), fillOption(fillOption) {
-        setColor(colorName);
+    bool contains(long long x, long long y) const {
+        return x >= left && x <= right && y >= top && y <= bottom;
     }
 
-    void setX(int newX) override {
-        x = newX;
+    bool intersects(const Bounds &other) const {
+        return !empty() && !other.empty() &&
+               left <= other.right && other.left <= right && top <= other.bottom && other.top <= bottom;
     }
 
-    void setY(int newY) override {
-        y = newY;
+    bool contains(const Bounds &other) const {
+        return other.empty() || (contains(other.left, other.top) && contains(other.right, other.bottom));
     }
 
-    void setHeight(int newH) {
-        height = newH;
+    Bounds intersection(const Bounds &other) const {
+        return {max(left, other.left), max(top, other.top), min(right, other.right), min(bottom, other.bottom)};
     }
 
-    void setWidth(int newW) {
-        width = newW;
+    Bounds united(const Bounds &other) const {
+        if (empty()) {
+            return other;
+        }
+        if (other.empty()) {
+            return *this;
+        }
+        return {min(left, other.left), min(top, other.top), max(right, other.right), max(bottom, other.bottom)};
     }
+};
 
-    FillOption getFillOption() const {
-        return fillOption;
+// Horizontal run of cells x1..x2 on row y.
+struct Span {
+    int y, x1, x2;
+};
+
+// Cells written by one shape, merged into spans, and the symbol it wrote them with.
+struct Recording {
+    vector<Span> spans;
+    char symbol = ' ';
+};
+
+struct AlignedDelete {
+    void operator()(char *p) const {
+        ::operator delete[](p, align_val_t(CACHE_LINE));
     }
+};
 
-    void draw(vector<vector<char> > &grid) override {
-        char symbol = getColorSymbol();
-        for (int i = 0; i < width; ++i) {
-            if (y >= 0 && y < BOARD_HEIGHT && x + i >= 0 && x + i < BOARD_WIDTH) {
-                grid[y][x + i] = symbol;
-            }
-            if (y + height - 1 >= 0 && y + height - 1 < BOARD_HEIGHT && x + i >= 0 && x + i < BOARD_WIDTH) {
-                grid[y + height - 1][x + i] = symbol;
-            }
-        }
-        for (int j = 0; j < height; ++j) {
-            if (y + j >= 0 && y + j < BOARD_HEIGHT && x >= 0 && x < BOARD_WIDTH) {
-                grid[y + j][x] = symbol;
-            }
-            if (y + j >= 0 && y + j < BOARD_HEIGHT && x + width - 1 >= 0 && x + width - 1 < BOARD_WIDTH) {
-                grid[y + j][x + width - 1] = symbol;
+// Where rasterizers write: the board's cells, and owner IDs when picking is on, seen
+// through a clip rectangle. Writes outside clip are dropped. Every thread drawing into
+// the board uses its own Canvas over a part of it.
+struct Canvas {
+    char *cells = nullptr;
+    int *owners = nullptr;
+    size_t stride = 0;
+    // Subtracted from every cell offset, so a buffer holding only part of the board can
+    // still be drawn with board coordinates. Unsigned arithmetic wraps, so this is exact.
+    size_t origin = 0;
+    int width = 0;
+    Bounds clip = {0, 0, -1, -1};
+    int pen = 0;
+    // While set, every write is also appended here; see RasterCache.
+    Recording *recording = nullptr;
+
+    // Extends the last span when the new cells continue it on either side.
+    void record(long long y, long long x1, long long x2, char symbol) {
+        vector<Span> &spans = recording->spans;
+        recording->symbol = symbol;
+        if (!spans.empty() && spans.back().y == y) {
+            Span &last = spans.back();
+            if (x1 == last.x2 + 1LL) {
+                last.x2 = static_cast<int>(x2);
+                return;
             }
-        }
-        if (fillOption == FILL) {
-            for (int i = 1; i <= width - 1; ++i) {
-                for (int j = 1; j <= height - 1; ++j) {
-                    if (y + j >= 0 && y + j < BOARD_HEIGHT && x + i >= 0 && x + i < BOARD_HEIGHT) {
-                        grid[y + j][x + i] = symbol;
-                    }
-                }
+            if (x2 + 1 == last.x1) {
+                last.x1 = static_cast<int>(x1);
+                return;
             }
         }
+        spans.push_back({static_cast<int>(y), static_cast<int>(x1), static_cast<int>(x2)});
     }
 
-    void print() const override {
-        cout << "Rectangle x: " << x << " y: " << y << " height: " << height << " width: " << width
-                << " Fill option: " << fillOptionType(fillOption) << " Color: " << color << endl;
+    // Unchecked write for rasterizers that clipped already.
+    void plot(long long x, long long y, char symbol) {
+        size_t offset = static_cast<size_t>(y) * stride + x - origin;
+        cells[offset] = symbol;
+        if (owners) {
+            owners[offset] = pen;
+        }
+        if (recording) {
+            record(y, x, x, symbol);
+        }
     }
 
-    string getType() const override {
-        return "Rectangle";
+    void set(int x, int y, char symbol) {
+        if (clip.contains(x, y)) {
+            plot(x, y, symbol);
+        }
     }
 
-    string getParams() const override {
-        return to_string(x) + " " + to_string(y) + " " + to_string(height) + " " + to_string(width);
+    // Unchecked span write; short spans are stored directly rather than through memset.
+    void plotSpan(long long y, long long x1, long long x2, char symbol) {
+        size_t offset = static_cast<size_t>(y) * stride + x1 - origin;
+        size_t count = static_cast<size_t>(x2 - x1 + 1);
+        if (count <= 8) {
+            for (size_t i = 0; i < count; ++i) {
+                cells[offset + i] = symbol;
+            }
+        } else {
+            memset(cells + offset, symbol, count);
+        }
+        if (owners) {
+            fill_n(owners + offset, count, pen);
+        }
+        if (recording) {
+            record(y, x1, x2, symbol);
+        }
     }
 
-    bool validBorder() const override {
-        return (x < BOARD_WIDTH && x + width > 0 &&
-                y < BOARD_HEIGHT && y + height > 0);
+    void fillSpan(long long y, long long x1, long long x2, char symbol) {
+        if (y < clip.top || y > clip.bottom) {
+            return;
+        }
+        x1 = max(x1, clip.left);
+        x2 = min(x2, clip.right);
+        if (x1 <= x2) {
+            plotSpan(y, x1, x2, symbol);
+        }
     }
 
-    bool coordinateContains(int cx, int cy) const override {
-        if (fillOption == FILL) {
-            return (cx >= x && cx <= x + width) && (cy >= y && cy <= y + height);
-        } else if (fillOption == FRAME) {
-            return (cx == x || cx == x + width) && (cy >= y && cy <= y + height) ||
-                   (cy == y || cy == y + height) && (cx >= x && cx <= x + width);
+    void fillRect(long long x1, long long y1, long long x2, long long y2, char symbol) {
+        y1 = max(y1, clip.top);
+        y2 = min(y2, clip.bottom);
+        if (y1 > y2) {
+            return;
+        }
+        if (x1 <= 0 && x2 >= width - 1 && clip.left == 0 && clip.right == width - 1 && !recording) {
+            // Whole rows: the padding past width is never shown, so one memset covers them all.
+            size_t offset = static_cast<size_t>(y1) * stride - origin;
+            size_t count = stride * static_cast<size_t>(y2 - y1 + 1);
+            memset(cells + offset, symbol, count);
+            if (owners) {
+                fill_n(owners + offset, count, pen);
+            }
+            return;
+        }
+        for (long long y = y1; y <= y2; ++y) {
+            fillSpan(y, x1, x2, symbol);
         }
-        return false;
     }
 };
 
-class Circle : public Shape {
-private:
-    int x, y;
-    int radius;
-    FillOption fillOption;
-
-public:
-    Circle(int x, int y, int radius, FillOption fillOption, const string &colorName) : x(x), y(y), radius(radius),
-        fillOption(fillOption) {
-        setColor(colorName);
+// Cells live in one row-major buffer; every row starts on a cache line, so
+// stride is the width rounded up to CACHE_LINE.
+struct Board {
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    unique_ptr<char[], AlignedDelete> cells;
+    vector<int> owners;
+    vector<char> frameBuffer;
+
+    static const size_t MAX_ESCAPE_LENGTH = 5;
+
+    // Cells hold one byte each: the colour letter a shape draws with, or a custom
+    // symbol set by edit. This maps every byte to its palette slot once.
+    static const array<unsigned char, 256> &paletteOfSymbols() {
+        static const array<unsigned char, 256> palette = [] {
+            array<unsigned char, 256> table{};
+            table.fill(WHITE);
+            for (int id = RED; id < PALETTE_SIZE; ++id) {
+                table[static_cast<unsigned char>(PALETTE[id].symbol)] = static_cast<unsigned char>(id);
+            }
+            table[static_cast<unsigned char>(' ')] = NO_COLOR;
+            return table;
+        }();
+        return palette;
     }
 
-    void setX(int newX) override {
-        x = newX;
-    }
+    // In differential mode the board stays on the alternate screen at rows 1..height
+    // and everything else scrolls in the region below it, so a frame only has to
+    // send the cells that differ from shownCells.
+    bool differential = isatty(STDOUT_FILENO);
+    bool screenActive = false;
+    vector<char> shownCells;
+    size_t lastRepaintBytes = 0;
 
-    void setY(int newY) override {
-        y = newY;
+    static const int MERGE_GAP = 8;
+    static const size_t MAX_CURSOR_LENGTH = 24;
+
+    static char *appendText(char *out, const char *text) {
+        while (*text) {
+            *out++ = *text++;
+        }
+        return out;
     }
 
-    void setRadius(int newR) {
-        radius = newR;
+    static char *appendEscape(char *out, unsigned char color) {
+        return appendText(out, PALETTE[color].code);
     }
 
-    FillOption getFillOption() const {
-        return fillOption;
+    static char *appendCursor(char *out, int line, int column) {
+        return out + snprintf(out, MAX_CURSOR_LENGTH, "\033[%d;%dH", line, column);
     }
 
-    void draw(vector<vector<char> > &grid) override {
-        char symbol = getColorSymbol();
-        for (int i = 0; i < BOARD_WIDTH; ++i) {
-            for (int j = 0; j < BOARD_HEIGHT; ++j) {
-                double distance = sqrt(pow(i - x, 2) + pow((j - y) * 2, 2));
-                if (fillOption == FRAME) {
-                    if (fabs(distance - radius) < 0.5) {
-                        grid[j][i] = symbol;
-                    }
-                } else if (fillOption == FILL) {
-                    if (distance <= radius) {
-                        grid[j][i] = symbol;
-                    }
-                }
+    char *appendCells(char *out, const char *cells, int count, unsigned char &current) const {
+        const auto &palette = paletteOfSymbols();
+        for (int x = 0; x < count; ++x) {
+            char symbol = cells[x];
+            unsigned char color = palette[static_cast<unsigned char>(symbol)];
+            if (color != current && symbol != ' ') {
+                out = appendEscape(out, color);
+                current = color;
             }
+            *out++ = symbol;
         }
+        return out;
     }
 
-    void print() const override {
-        cout << "Circle x: " << x << " y: " << y << " radius: " << radius << " Fill option: " <<
-                fillOptionType(fillOption) << " Color: " << color << endl;
-    }
-
-    string getType() const override {
-        return "Circle";
+    size_t rowWorstCase() const {
+        return static_cast<size_t>(width) * (MAX_ESCAPE_LENGTH + 1) + MAX_ESCAPE_LENGTH + MAX_CURSOR_LENGTH;
     }
 
-    string getParams() const override {
-        return to_string(x) + " " + to_string(y) + " " + to_string(radius);
+    char *reserveFrame(char *out, size_t extra) {
+        size_t used = out - frameBuffer.data();
+        if (frameBuffer.size() < used + extra) {
+            frameBuffer.resize(max(frameBuffer.size() * 2, used + extra));
+        }
+        return frameBuffer.data() + used;
     }
 
-    bool validBorder() const override {
-        bool withinBoard = radius * 2 <= BOARD_WIDTH && radius * 2 <= BOARD_HEIGHT;
-        bool partOfBoard = (x + radius >= 0 && x - radius < BOARD_WIDTH &&
-                            y + radius >= 0 && y - radius < BOARD_HEIGHT);
-        return withinBoard && partOfBoard;
+    // Sends the frame with one write, looping only if the terminal takes part of it.
+    // Text already buffered in cout goes first, so output stays in order.
+    void flushFrame(const char *out) {
+        cout.flush();
+        const char *next = frameBuffer.data();
+        while (next < out) {
+            ssize_t written = write(STDOUT_FILENO, next, static_cast<size_t>(out - next));
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return;
+            }
+            next += written;
+        }
     }
 
-    bool coordinateContains(int cx, int cy) const override {
-        double distance = sqrt(pow(cx - x, 2) + pow((cy - y) * 2, 2));
-
-        if (fillOption == FILL) {
-            return distance <= radius;
-        } else if (fillOption == FRAME) {
-            return fabs(distance - radius) < 0.5;
+    int terminalLines() const {
+        winsize size{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0) {
+            return 0;
         }
-        return false;
+        return size.ws_row;
     }
-};
-
-class Line : public Shape {
-private:
-    bool change = false;
-    char customSymbol;
-    int x1, y1, x2, y2;
-    bool isTriangle;
 
-public:
-    Line(int x1, int y1, int x2, int y2, bool isTriangle, const string &colorName)
-        : x1(x1), y1(y1), x2(x2), y2(y2), isTriangle(isTriangle) {
-        setColor(colorName);
-        customSymbol = getColorSymbol();
+    bool terminalFits() const {
+        winsize size{};
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) != 0) {
+            return false;
+        }
+        return height + 2 <= size.ws_row && width <= size.ws_col;
     }
 
-    bool changeSymbol() const {
-        return change;
+    void leaveScreen() {
+        if (screenActive) {
+            cout << "\033[r\033[?1049l" << flush;
+            screenActive = false;
+            shownCells.clear();
+        }
     }
 
-    void setCustomSymbol(char symbol) {
-        customSymbol = symbol;
-        change = true;
+    void printToScreen() {
+        size_t cellCount = static_cast<size_t>(width) * height;
+        bool layoutChanged = !screenActive || shownCells.size() != cellCount;
+        char *out = frameBuffer.data();
+        if (layoutChanged || !appendChanges(out)) {
+            out = appendRepaint(frameBuffer.data(), layoutChanged);
+        }
+        flushFrame(out);
     }
 
-    int getX() const override { return x1; }
-    int getY() const override { return y1; }
-    void setX(int newX) override { x1 = newX; }
-    void setY(int newY) override { y1 = newY; }
-
-    int getX2() const { return x2; }
-    int getY2() const { return y2; }
-    void setX2(int newX2) { x2 = newX2; }
-    void setY2(int newY2) { y2 = newY2; }
-
-    void draw(vector<vector<char> > &grid) override {
-        char symbol = getColorSymbol();
-        int deltaX = x2 - x1;
-        int deltaY = y2 - y1;
-        int steps = max(abs(deltaX), abs(deltaY));
-        float xIncrement = deltaX / static_cast<float>(steps);
-        float yIncrement = deltaY / static_cast<float>(steps);
-        float x = x1;
-        float y = y1;
-
-        int prevX;
-        int prevY;
-
-        for (int i = 0; i <= steps; ++i) {
-            int gridX = round(x);
-            int gridY = round(y);
-
-            if (isTriangle) {
-                if (gridX == prevX && gridY == prevY) {
-                    x += xIncrement;
-                    y += yIncrement;
+    // Writes changed runs of each row behind a cursor move. Unchanged gaps shorter than
+    // MERGE_GAP are resent rather than paying for another cursor move. Gives up and
+    // returns false once the diff outgrows the last full repaint.
+    bool appendChanges(char *&out) {
+        out = reserveFrame(out, 2);
+        out = appendText(out, "\033" "7");
+        unsigned char current = NO_COLOR;
+        for (int y = 0; y < height; ++y) {
+            const char *cells = row(y);
+            char *shown = shownCells.data() + static_cast<size_t>(y) * width;
+            int x = 0;
+            while (x < width) {
+                if (cells[x] == shown[x]) {
+                    ++x;
                     continue;
                 }
-            } else {
-                if ((gridX == prevX && gridY == prevY) || (gridX == prevX || gridY == prevY)) {
-                    x += xIncrement;
-                    y += yIncrement;
-                    continue;
+                int runEnd = x + 1;
+                for (int i = runEnd; i < width && i - runEnd < MERGE_GAP; ++i) {
+                    if (cells[i] != shown[i]) {
+                        runEnd = i + 1;
+                    }
                 }
-            }
-
-            if (gridX >= 0 && gridX < BOARD_WIDTH && gridY >= 0 && gridY < BOARD_HEIGHT) {
-                if (changeSymbol()) {
-                    grid[gridY][gridX] = customSymbol;
-                } else {
-                    grid[gridY][gridX] = symbol;
+                out = reserveFrame(out, MAX_CURSOR_LENGTH + static_cast<size_t>(runEnd - x) * (MAX_ESCAPE_LENGTH + 1));
+                out = appendCursor(out, y + 1, x + 1);
+                out = appendCells(out, cells + x, runEnd - x, current);
+                memcpy(shown + x, cells + x, runEnd - x);
+                if (static_cast<size_t>(out - frameBuffer.data()) > lastRepaintBytes) {
+                    return false;
                 }
+                x = runEnd;
             }
+        }
+        out = reserveFrame(out, MAX_ESCAPE_LENGTH + 2);
+        if (current != NO_COLOR) {
+            out = appendEscape(out, NO_COLOR);
+        }
+        out = appendText(out, "\033" "8");
+        return true;
+    }
 
+    // Repaints every row in place. When the layout changed (first frame or a resize) the
+    // screen is cleared and the scroll region is set to the lines under the board.
+    char *appendRepaint(char *out, bool layoutChanged) {
+        out = reserveFrame(out, 32);
+        if (layoutChanged) {
+            out = appendText(out, screenActive ? "\033[r\033[2J" : "\033[?1049h\033[2J");
+        } else {
+            out = appendText(out, "\033" "7");
+        }
+        for (int y = 0; y < height; ++y) {
+            out = reserveFrame(out, rowWorstCase());
+            unsigned char current = NO_COLOR;
+            out = appendCursor(out, y + 1, 1);
+            out = appendCells(out, row(y), width, current);
+            if (current != NO_COLOR) {
+                out = appendEscape(out, NO_COLOR);
+            }
+        }
+        out = reserveFrame(out, 2 * MAX_CURSOR_LENGTH);
+        if (layoutChanged) {
+            out += snprintf(out, MAX_CURSOR_LENGTH, "\033[%d;%dr", height + 1, terminalLines());
+            out = appendCursor(out, height + 1, 1);
+        } else {
+            out = appendText(out, "\033" "8");
+        }
+        lastRepaintBytes = out - frameBuffer.data();
 
-            prevX = gridX;
-            prevY = gridY;
-
-            x += xIncrement;
-            y += yIncrement;
+        shownCells.resize(static_cast<size_t>(width) * height);
+        for (int y = 0; y < height; ++y) {
+            memcpy(shownCells.data() + static_cast<size_t>(y) * width, row(y), width);
         }
+        screenActive = true;
+        return out;
     }
 
-    void print() const override {
-        cout << "Line x1: " << x1 << " y1: " << y1 << " x2: " << x2 << " y2: " << y2 << " Color: " << color << endl;
+    Board(int width = DEFAULT_BOARD_WIDTH, int height = DEFAULT_BOARD_HEIGHT) {
+        resize(width, height);
     }
 
-    string getType() const override {
-        return "Line";
+    ~Board() {
+        leaveScreen();
     }
 
-    string getParams() const override {
-        return to_string(x1) + ' ' + to_string(y1) + ' ' + to_string(x2) + ' ' + to_string(y2);
+    void resize(int newWidth, int newHeight) {
+        if (newWidth <= 0 || newHeight <= 0) {
+            throw invalid_argument("Board size must be positive.");
+        }
+        size_t newStride = (static_cast<size_t>(newWidth) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+        size_t size = newStride * static_cast<size_t>(newHeight);
+        cells.reset(static_cast<char *>(::operator new[](size, align_val_t(CACHE_LINE))));
+        width = newWidth;
+        height = newHeight;
+        stride = static_cast<int>(newStride);
+        shownCells.clear();
+        if (ownersEnabled()) {
+            setOwnersEnabled(true);
+        }
+        clear();
     }
 
-    bool validBorder() const override {
-        return (x1 < BOARD_WIDTH && x1 >= 0 && y1 < BOARD_HEIGHT && y1 >= 0) ||
-               (x2 < BOARD_WIDTH && x2 >= 0 && y2 < BOARD_HEIGHT && y2 >= 0);
+    char *row(int y) {
+        return cells.get() + static_cast<size_t>(y) * stride;
     }
 
-    bool coordinateContains(int cx, int cy) const override {
-        double dx = x2 - x1;
-        double dy = y2 - y1;
-        double lenSquare = dx * dx + dy * dy;
-        if (lenSquare == 0) {
-            return (cx == x1 && cy == y1);
-        }
-        double t = ((cx - x1) * dx + (cy - y1) * dy) / lenSquare;
-        t = max(0.0, min(1.0, t));
-        double closestX = x1 + t * dx;
-        double closestY = y1 + t * dy;
-        double distance = sqrt(pow(cx - closestX, 2) + pow(cy - closestY, 2));
-        return distance < 0.5;
+    const char *row(int y) const {
+        return cells.get() + static_cast<size_t>(y) * stride;
     }
-};
-
-class Triangle : public Shape {
-private:
-    bool change = false;
-    char customSymbol;
-    int x1, y1, x2, y2, x3, y3;
-    FillOption fillOption;
 
-    bool edgeIntersecting(int y1, int y2, int y) const {
-        return (y1 <= y && y2 > y) || (y2 <= y && y1 > y);
+    Bounds bounds() const {
+        return {0, 0, width - 1LL, height - 1LL};
     }
 
-    int intersectionX(int y1, int y2, int x1, int x2, int y) const {
-        return x1 + (x2 - x1) * (y - y1) / (y2 - y1);
+    // A canvas that writes into the part of the board inside region.
+    Canvas canvas(const Bounds &region) {
+        Canvas canvas;
+        canvas.cells = cells.get();
+        canvas.owners = ownersEnabled() ? owners.data() : nullptr;
+        canvas.stride = stride;
+        canvas.width = width;
+        canvas.clip = bounds().intersection(region);
+        return canvas;
     }
 
-    void scanlineAlgorithm(vector<vector<char> > &grid, char symbol) const {
-        int yMin = min({y1, y2, y3});
-        int yMax = max({y1, y2, y3});
+    // Owner IDs parallel to the cells: while enabled, every canvas write also records
+    // the canvas pen, the ID of the shape being drawn. 0 means no shape.
+    bool ownersEnabled() const {
+        return !owners.empty();
+    }
 
-        for (int y = yMin; y <= yMax; ++y) {
-            vector<int> intersections;
-            if (edgeIntersecting(y1, y2, y)) {
-                intersections.push_back(intersectionX(y1, y2, x1, x2, y));
-            }
-            if (edgeIntersecting(y2, y3, y)) {
-                intersections.push_back(intersectionX(y2, y3, x2, x3, y));
-            }
-            if (edgeIntersecting(y3, y1, y)) {
-                intersections.push_back(intersectionX(y3, y1, x3, x1, y));
-            }
+    void setOwnersEnabled(bool enabled) {
+        if (enabled) {
+            owners.assign(static_cast<size_t>(stride) * height, 0);
+        } else {
+            owners.clear();
+            owners.shrink_to_fit();
+        }
+    }
 
-            if (intersections.size() >= 2) {
-                sort(intersections.begin(), intersections.end());
-                int start = intersections[0];
-                int end = intersections.back();
+    int ownerAt(long long x, long long y) const {
+        if (!ownersEnabled() || x < 0 || x >= width || y < 0 || y >= height) {
+            return 0;
+        }
+        return owners[static_cast<size_t>(y) * stride + x];
+    }
 
-                for (int x = start; x <= end; ++x) {
-                    if (x >= 0 && x < BOARD_WIDTH && y >= 0 && y < BOARD_HEIGHT) {
-                        grid[y][x] = symbol;
-                    }
-                }
+    // Each frame is assembled in frameBuffer, which is reused across frames, and written
+    // with one call. A colour escape is emitted only when the colour changes along a row;
+    // blanks keep the current colour since they show no foreground.
+    void print() {
+        if (differential && terminalFits()) {
+            printToScreen();
+            return;
+        }
+        leaveScreen();
+        char *out = frameBuffer.data();
+        for (int y = 0; y < height; ++y) {
+            out = reserveFrame(out, rowWorstCase());
+            unsigned char current = NO_COLOR;
+            out = appendCells(out, row(y), width, current);
+            if (current != NO_COLOR) {
+                out = appendEscape(out, NO_COLOR);
             }
+            *out++ = '\n';
         }
+        flushFrame(out);
     }
 
+    void setDifferential(bool enabled) {
+        differential = enabled;
+        if (!enabled) {
+            leaveScreen();
+        }
+    }
 
-    void drawLines(vector<vector<char> > &grid, char symbol) const {
-        Line line1(x1, y1, x2, y2, true, color);
-        line1.setCustomSymbol(symbol);
-        line1.draw(grid);
-        Line line2(x2, y2, x3, y3, true, color);
-        line2.setCustomSymbol(symbol);
-        line2.draw(grid);
-        Line line3(x3, y3, x1, y1, true, color);
-        line3.setCustomSymbol(symbol);
-        line3.draw(grid);
+    void clear() {
+        memset(cells.get(), ' ', static_cast<size_t>(stride) * height);
+        if (ownersEnabled()) {
+            fill(owners.begin(), owners.end(), 0);
+        }
     }
+};
 
-    bool triangleEdges(int сx, int сy) const {
-        Line edge1(x1, y1, x2, y2, false, color);
-        Line edge2(x2, y2, x3, y3, false, color);
-        Line edge3(x3, y3, x1, y1, false, color);
+enum ShapeKind : unsigned char { RECTANGLE, CIRCLE, LINE, TRIANGLE };
 
-        return edge1.coordinateContains(сx, сy) ||
-               edge2.coordinateContains(сx, сy) ||
-               edge3.coordinateContains(сx, сy);
-    }
+// Binary form of getType() + getParams(): the shape kind and its geometry, with
+// unused parameters left at 0. Two shapes with equal keys are duplicates.
+struct ShapeKey {
+    ShapeKind kind;
+    int params[6];
 
-public:
-    Triangle(int x1, int y1, int x2, int y2, int x3, int y3, FillOption fillOption, const string &colorName)
-        : x1(x1), y1(y1), x2(x2), y2(y2), x3(x3), y3(y3), fillOption(fillOption) {
-        setColor(colorName);
-        customSymbol = getColorSymbol();
+    bool operator==(const ShapeKey &other) const {
+        return kind == other.kind && equal(begin(params), end(params), begin(other.params));
     }
+};
 
-    FillOption getFillOption() const {
-        return fillOption;
+struct ShapeKeyHash {
+    size_t operator()(const ShapeKey &key) const {
+        unsigned long long hash = key.kind;
+        for (int param: key.params) {
+            hash = (hash ^ static_cast<unsigned int>(param)) * 0x100000001b3ULL;
+            hash ^= hash >> 29;
+        }
+        return static_cast<size_t>(hash);
     }
+};
 
-    int getX() const override { return x1; }
-    int getY() const override { return y1; }
-    void setX(int newX) override { x1 = newX; }
-    void setY(int newY) override { y1 = newY; }
+class Shape {
+protected:
+    ColorId colorId = NO_COLOR;
 
-    int getX2() const { return x2; }
-    int getY2() const { return y2; }
-    void setX2(int newX2) { x2 = newX2; }
-    void setY2(int newY2) { y2 = newY2; }
+public:
+    string getColor() const {
+        return PALETTE[colorId].name;
+    }
 
-    int getX3() const { return x3; }
-    int getY3() const { return y3; }
-    void setX3(int newX3) { x3 = newX3; }
-    void setY3(int newY3) { y3 = newY3; }
+    void setColor(string_view c) {
+        colorId = colorIdOf(c);
+    }
 
-    bool changeSymbol() const {
-        return change;
+    ColorId getColorId() const {
+        return colorId;
     }
 
-    void setCustomSymbol(char symbol) {
-        customSymbol = symbol;
-        change = true;
+    char getColorSymbol() const {
+        return PALETTE[colorId].symbol;
     }
+};
+
+
+class Rectangle : public Shape {
+private:
+    int x, y, height, width;
+    FillOption fillOption;
 
-    bool validBorder() const override {
-        return (x1 < BOARD_WIDTH && x1 >= 0 && y1 < BOARD_HEIGHT && y1 >= 0) ||
-               (x2 < BOARD_WIDTH && x2 >= 0 && y2 < BOARD_HEIGHT && y2 >= 0) ||
-               (x3 < BOARD_WIDTH && x3 >= 0 && y3 < BOARD_HEIGHT && y3 >= 0);
+public:
+    Rectangle(int x, int y, int height, int width, FillOption fillOption, string_view colorName)
+        : x(x), y(y), height(height), width(width), fillOption(fillOption) {
+        setColor(colorName);
     }
 
-    void draw(vector<vector<char> > &grid) override {
-        char symbol;
-        if (change) {
-            symbol = customSymbol;
-        } else {
-            symbol = getColorSymbol();
+    void setHeight(int newH) {
+        height = newH;
+    }
+
+    void setWidth(int newW) {
+        width = newW;
+    }
+
+    FillOption getFillOption() const {
+        return fillOption;
+    }
+
+    // Clipped to the canvas once: FILL is one span per row, FRAME is the top and bottom
+    // spans plus the visible cells of the two side columns.
+    void draw(Canvas &canvas) {
+        if (width <= 0 || height <= 0) {
+            return;
         }
-        drawLines(grid, symbol);
+        char symbol = getColorSymbol();
+        long long left = x, top = y;
+        long long right = left + width - 1, bottom = top + height - 1;
+        if (fillOption == FILL) {
+            canvas.fillRect(left, top, right, bottom, symbol);
+            return;
+        }
+
+        canvas.fillSpan(top, left, right, symbol);
+        canvas.fillSpan(bottom, left, right, symbol);
+        bool leftVisible = left >= canvas.clip.left && left <= canvas.clip.right;
+        bool rightVisible = right >= canvas.clip.left && right <= canvas.clip.right;
+        if (!leftVisible && !rightVisible) {
+            return;
+        }
+        long long firstRow = max(top + 1, canvas.clip.top);
+        long long lastRow = min(bottom - 1, canvas.clip.bottom);
+        for (long long row = firstRow; row <= lastRow; ++row) {
+            if (leftVisible) {
+                canvas.plot(left, row, symbol);
+            }
+            if (rightVisible) {
+                canvas.plot(right, row, symbol);
+            }
+        }
+    }
+
+    void print() const {
+        cout << "Rectangle x: " << x << " y: " << y << " height: " << height << " width: " << width
+                << " Fill option: " << fillOptionType(fillOption) << " Color: " << getColor() << endl;
+    }
+
+    string getType() const {
+        return "Rectangle";
+    }
+
+    string getParams() const {
+        return to_string(x) + " " + to_string(y) + " " + to_string(height) + " " + to_string(width);
+    }
+
+    ShapeKey getKey() const {
+        return {RECTANGLE, {x, y, height, width, 0, 0}};
+    }
+
+    Bounds getBounds() const {
+        return {x, y, static_cast<long long>(x) + width - 1, static_cast<long long>(y) + height - 1};
+    }
+
+    Bounds getHitBounds() const {
+        return {x, y, static_cast<long long>(x) + width, static_cast<long long>(y) + height};
+    }
+
+    bool validBorder(const Board &board) const {
+        return getBounds().intersects(board.bounds());
+    }
+
+    void moveTo(int newX, int newY) {
+        x = newX;
+        y = newY;
+    }
 
+    bool coordinateContains(int cx, int cy) const {
         if (fillOption == FILL) {
-            scanlineAlgorithm(grid, symbol);
+            return (cx >= x && cx <= x + width) && (cy >= y && cy <= y + height);
+        } else if (fillOption == FRAME) {
+            return (cx == x || cx == x + width) && (cy >= y && cy <= y + height) ||
+                   (cy == y || cy == y + height) && (cx >= x && cx <= x + width);
         }
+        return false;
     }
+};
 
-    void print() const override {
-        cout << "Triangle x1: " << x1 << " y1: " << y1 << " x2: " << x2 << " y2: " << y2 << " x3: " << x3 << " y3: " <<
-                y3 << " Fill option: " << fillOptionType(fillOption) << " Color: " << color << endl;
+class Circle : public Shape {
+private:
+    int x, y;
+    int radius;
+    FillOption fillOption;
+
+    static long long integerSqrt(long long n) {
+        long long root = static_cast<long long>(sqrt(static_cast<double>(n)));
+        while (root * root > n) {
+            --root;
+        }
+        while ((root + 1) * (root + 1) <= n) {
+            ++root;
+        }
+        return root;
     }
 
-    string getType() const override {
-        return "Triangle";
+    long long outerLimit() const {
+        long long r = radius;
+        return fillOption == FILL ? r * r : r * r + r;
     }
 
-    string getParams() const override {
-        return to_string(x1) + ' ' + to_string(y1) + ' ' + to_string(x2) + ' ' + to_string(y2) + ' ' + to_string(x3) +
-               ' ' + to_string(y3);
+    void drawRow(Canvas &canvas, long long row, long long dxInner, long long dxOuter, char symbol) const {
+        if (dxInner == 0) {
+            canvas.fillSpan(row, x - dxOuter, x + dxOuter, symbol);
+        } else if (dxInner <= dxOuter) {
+            canvas.fillSpan(row, x - dxOuter, x - dxInner, symbol);
+            canvas.fillSpan(row, x + dxInner, x + dxOuter, symbol);
+        }
+    }
+
+public:
+    Circle(int x, int y, int radius, FillOption fillOption, string_view colorName) : x(x), y(y), radius(radius),
+        fillOption(fillOption) {
+        setColor(colorName);
+    }
+
+    void setRadius(int newR) {
+        radius = newR;
+    }
+
+    FillOption getFillOption() const {
+        return fillOption;
+    }
+
+    // Cell (i, j) belongs to the circle when d = (i - x)^2 + ((j - y) * 2)^2 passes the
+    // same tests coordinateContains does with sqrt: FILL is d <= r^2, FRAME is
+    // r^2 - r < d <= r^2 + r. Rows are walked midpoint-style: the outer and inner
+    // half-widths only shrink as |j - y| grows, so each is decremented in place.
+    void draw(Canvas &canvas) {
+        if (radius < 0) {
+            return;
+        }
+        char symbol = getColorSymbol();
+        long long r = radius;
+        long long outer = outerLimit();
+        long long inner = fillOption == FILL || r == 0 ? -1 : r * r - r;
+        long long cy = y, firstRow = canvas.clip.top, lastRow = canvas.clip.bottom;
+
+        long long dyMax = integerSqrt(outer / 4);
+        long long dyFirst = max({0LL, firstRow - cy, cy - lastRow});
+        long long dyLast = min(dyMax, max(cy - firstRow, lastRow - cy));
+        if (dyFirst > dyLast) {
+            return;
+        }
+
+        long long dxOuter = integerSqrt(outer - 4 * dyFirst * dyFirst);
+        long long innerLimit = inner - 4 * dyFirst * dyFirst;
+        long long dxInner = innerLimit < 0 ? 0 : integerSqrt(innerLimit) + 1;
+
+        for (long long dy = dyFirst; dy <= dyLast; ++dy) {
+            long long outerLimit = outer - 4 * dy * dy;
+            innerLimit = inner - 4 * dy * dy;
+            while (dxOuter * dxOuter > outerLimit) {
+                --dxOuter;
+            }
+            while (dxInner > 0 && (dxInner - 1) * (dxInner - 1) > innerLimit) {
+                --dxInner;
+            }
+            drawRow(canvas, cy + dy, dxInner, dxOuter, symbol);
+            if (dy != 0) {
+                drawRow(canvas, cy - dy, dxInner, dxOuter, symbol);
+            }
+        }
+    }
+
+    void print() const {
+        cout << "Circle x: " << x << " y: " << y << " radius: " << radius << " Fill option: " <<
+                fillOptionType(fillOption) << " Color: " << getColor() << endl;
+    }
+
+    string getType() const {
+        return "Circle";
+    }
+
+    string getParams() const {
+        return to_string(x) + " " + to_string(y) + " " + to_string(radius);
+    }
+
+    ShapeKey getKey() const {
+        return {CIRCLE, {x, y, radius, 0, 0, 0}};
+    }
+
+    // Rows reach |j - y| <= sqrt(outer) / 2 because of the aspect correction.
+    Bounds getBounds() const {
+        if (radius < 0) {
+            return {x, y, x - 1LL, y - 1LL};
+        }
+        long long halfHeight = integerSqrt(outerLimit() / 4);
+        return {static_cast<long long>(x) - radius, y - halfHeight, static_cast<long long>(x) + radius, y + halfHeight};
+    }
+
+    Bounds getHitBounds() const {
+        return getBounds();
+    }
+
+    // Kept as the original rule: the radius bounds the circle on both axes, so a
+    // circle can be accepted with its aspect-corrected rows all off the board.
+    bool validBorder(const Board &board) const {
+        long long r = radius;
+        bool withinBoard = r * 2 <= board.width && r * 2 <= board.height;
+        bool partOfBoard = x + r >= 0 && x - r < board.width && y + r >= 0 && y - r < board.height;
+        return withinBoard && partOfBoard;
     }
 
-    bool coordinateContains(int cx, int cy) const override {
+    void moveTo(int newX, int newY) {
+        x = newX;
+        y = newY;
+    }
+
+    bool coordinateContains(int cx, int cy) const {
+        double distance = sqrt(pow(cx - x, 2) + pow((cy - y) * 2, 2));
+
         if (fillOption == FILL) {
-            double divider = (y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3);
-            double lambda1 = ((y2 - y3) * (cx - x3) + (x3 - x2) * (cy - y3)) / divider;
-            double lambda2 = ((y3 - y1) * (cx - x3) + (x1 - x3) * (cy - y3)) / divider;
-            double lambda3 = 1 - lambda1 - lambda2;
-            return lambda1 >= -0.2 && lambda2 >= -0.2 && lambda3 >= -0.2;
+            return distance <= radius;
         } else if (fillOption == FRAME) {
-            return triangleEdges(cy, cx);
+            return fabs(distance - radius) < 0.5;
         }
         return false;
     }
 };
 
+class Line : public Shape {
+private:
+    bool change = false;
+    char customSymbol;
+    int x1, y1, x2, y2;
+    bool isTriangle;
+
+    // floor((2 * step * delta + steps) / (2 * steps)) for deltas up to 2^32 without overflow.
+    static long long minorOffset(unsigned long long step, unsigned long long delta, unsigned long long steps) {
+        unsigned long long product = step * delta;
+        return static_cast<long long>(product / steps + (2 * (product % steps) + steps) / (2 * steps));
+    }
+
+    // Smallest step whose minor offset is >= target (steps + 1 if none). The offset is
+    // monotonic in the step, so a floating estimate is corrected with exact checks.
+    static long long firstStepReaching(long long target, unsigned long long delta, unsigned long long steps) {
+        long long last = static_cast<long long>(steps);
+        if (target <= 0) {
+            return 0;
+        }
+        if (delta == 0 || target > static_cast<long long>(delta)) {
+            return last + 1;
+        }
+        double estimate = ceil(static_cast<double>(steps) * (2.0 * target - 1) / (2.0 * delta));
+        long long step = max(0LL, min(last, static_cast<long long>(estimate)));
+        while (step > 0 && minorOffset(step - 1, delta, steps) >= target) {
+            --step;
+        }
+        while (step <= last && minorOffset(step, delta, steps) < target) {
+            ++step;
+        }
+        return step;
+    }
+
+    // Largest step whose minor offset is <= target (-1 if none).
+    static long long lastStepWithin(long long target, unsigned long long delta, unsigned long long steps) {
+        long long last = static_cast<long long>(steps);
+        if (target < 0) {
+            return -1;
+        }
+        if (delta == 0 || target >= static_cast<long long>(delta)) {
+            return last;
+        }
+        double estimate = floor(static_cast<double>(steps) * (2.0 * target + 1) / (2.0 * delta));
+        long long step = max(0LL, min(last, static_cast<long long>(estimate)));
+        while (step < last && minorOffset(step + 1, delta, steps) <= target) {
+            ++step;
+        }
+        while (step >= 0 && minorOffset(step, delta, steps) > target) {
+            --step;
+        }
+        return step;
+    }
+
+public:
+    Line(int x1, int y1, int x2, int y2, bool isTriangle, string_view colorName)
+        : x1(x1), y1(y1), x2(x2), y2(y2), isTriangle(isTriangle) {
+        setColor(colorName);
+        customSymbol = getColorSymbol();
+    }
+
+    bool changeSymbol() const {
+        return change;
+    }
+
+    char getCustomSymbol() const {
+        return customSymbol;
+    }
+
+    void setCustomSymbol(char symbol) {
+        customSymbol = symbol;
+        change = true;
+    }
+
+    // Integer line engine shared by Line and Triangle outlines. The segment advances one
+    // cell per step along its major axis; the minor offset at step i is
+    // i * minorDelta / steps rounded half up, tracked as a quotient and remainder.
+    // The step range is clipped to the canvas before walking, so a segment whose ends
+    // are far outside it costs only its visible part. Outside triangle mode a cell
+    // is drawn only when the minor coordinate moved since the previous step.
+    static void rasterize(Canvas &canvas, int x1, int y1, int x2, int y2, bool isTriangle, char symbol) {
+        long long dx = static_cast<long long>(x2) - x1;
+        long long dy = static_cast<long long>(y2) - y1;
+        unsigned long long steps = max(llabs(dx), llabs(dy));
+        if (steps == 0) {
+            canvas.set(x1, y1, symbol);
+            return;
+        }
+
+        bool xMajor = llabs(dx) >= llabs(dy);
+        long long majorStart = xMajor ? x1 : y1;
+        long long minorStart = xMajor ? y1 : x1;
+        long long majorSign = (xMajor ? dx : dy) < 0 ? -1 : 1;
+        long long minorSign = (xMajor ? dy : dx) < 0 ? -1 : 1;
+        unsigned long long minorDelta = llabs(xMajor ? dy : dx);
+        const Bounds &clip = canvas.clip;
+        long long majorFirst = xMajor ? clip.left : clip.top, majorLast = xMajor ? clip.right : clip.bottom;
+        long long minorFirst = xMajor ? clip.top : clip.left, minorLast = xMajor ? clip.bottom : clip.right;
+
+        long long first = 0, last = static_cast<long long>(steps);
+        if (majorSign > 0) {
+            first = max(first, majorFirst - majorStart);
+            last = min(last, majorLast - majorStart);
+        } else {
+            first = max(first, majorStart - majorLast);
+            last = min(last, majorStart - majorFirst);
+        }
+        long long lowOffset = minorSign > 0 ? minorFirst - minorStart : minorStart - minorLast;
+        long long highOffset = minorSign > 0 ? minorLast - minorStart : minorStart - minorFirst;
+        first = max(first, firstStepReaching(lowOffset, minorDelta, steps));
+        last = min(last, lastStepWithin(highOffset, minorDelta, steps));
+        if (first > last) {
+            return;
+        }
+
+        unsigned long long product = static_cast<unsigned long long>(first) * minorDelta;
+        unsigned long long quotient = product / steps;
+        unsigned long long remainder = product % steps;
+        long long prevOffset = first > 0 ? minorOffset(first - 1, minorDelta, steps) : -1;
+        for (long long i = first; i <= last; ++i) {
+            long long offset = static_cast<long long>(quotient) + (2 * remainder >= steps ? 1 : 0);
+            if (isTriangle || offset != prevOffset) {
+                long long major = majorStart + majorSign * i;
+                long long minor = minorStart + minorSign * offset;
+                if (xMajor) {
+                    canvas.plot(major, minor, symbol);
+                } else {
+                    canvas.plot(minor, major, symbol);
+                }
+            }
+            prevOffset = offset;
+            remainder += minorDelta;
+            if (remainder >= steps) {
+                remainder -= steps;
+                ++quotient;
+            }
+        }
+    }
+
+    void draw(Canvas &canvas) {
+        rasterize(canvas, x1, y1, x2, y2, isTriangle, changeSymbol() ? customSymbol : getColorSymbol());
+    }
+
+    void print() const {
+        cout << "Line x1: " << x1 << " y1: " << y1 << " x2: " << x2 << " y2: " << y2 << " Color: " << getColor() << endl;
+    }
+
+    string getType() const {
+        return "Line";
+    }
+
+    string getParams() const {
+        return to_string(x1) + ' ' + to_string(y1) + ' ' + to_string(x2) + ' ' + to_string(y2);
+    }
+
+    ShapeKey getKey() const {
+        return {LINE, {x1, y1, x2, y2, 0, 0}};
+    }
+
+    Bounds getBounds() const {
+        return {min(x1, x2), min(y1, y2), max(x1, x2), max(y1, y2)};
+    }
+
+    Bounds getHitBounds() const {
+        return getBounds();
+    }
+
+    bool validBorder(const Board &board) const {
+        return getBounds().intersects(board.bounds());
+    }
+
+    // Moves the first point to (newX, newY); the second keeps its offset from it.
+    void moveTo(int newX, int newY) {
+        x2 += newX - x1;
+        y2 += newY - y1;
+        x1 = newX;
+        y1 = newY;
+    }
+
+    bool coordinateContains(int cx, int cy) const {
+        return segmentContains(x1, y1, x2, y2, cx, cy);
+    }
+
+    static bool segmentContains(int x1, int y1, int x2, int y2, int cx, int cy) {
+        double dx = x2 - x1;
+        double dy = y2 - y1;
+        double lenSquare = dx * dx + dy * dy;
+        if (lenSquare == 0) {
+            return (cx == x1 && cy == y1);
+        }
+        double t = ((cx - x1) * dx + (cy - y1) * dy) / lenSquare;
+        t = max(0.0, min(1.0, t));
+        double closestX = x1 + t * dx;
+        double closestY = y1 + t * dy;
+        double distance = sqrt(pow(cx - closestX, 2) + pow(cy - closestY, 2));
+        return distance < 0.5;
+    }
+};
+
+class Triangle : public Shape {
+private:
+    bool change = false;
+    char customSymbol;
+    int x1, y1, x2, y2, x3, y3;
+    FillOption fillOption;
+
+    // One triangle edge stepped a row at a time. Its x on row y is the truncated
+    // baseX + (otherX - baseX) * (y - baseY) / (otherY - baseY), kept in fixed point as an
+    // integer quotient plus a remainder over the edge height.
+    struct EdgeWalker {
+        long long baseX = 0, sign = 1, direction = 1;
+        long long quotient = 0, remainder = 0;
+        long long quotientStep = 0, remainderStep = 0, height = 1;
+
+        EdgeWalker() = default;
+
+        EdgeWalker(long long baseX, long long baseY, long long otherX, long long otherY, long long row)
+            : baseX(baseX), sign(otherX < baseX ? -1 : 1), direction(otherY > baseY ? 1 : -1),
+              height(llabs(otherY - baseY)) {
+            unsigned long long width = llabs(otherX - baseX);
+            unsigned long long product = width * static_cast<unsigned long long>(llabs(row - baseY));
+            quotient = static_cast<long long>(product / height);
+            remainder = static_cast<long long>(product % height);
+            quotientStep = static_cast<long long>(width / height);
+            remainderStep = static_cast<long long>(width % height);
+        }
+
+        long long x() const {
+            return baseX + sign * quotient;
+        }
+
+        void nextRow() {
+            if (direction > 0) {
+                quotient += quotientStep;
+                remainder += remainderStep;
+                if (remainder >= height) {
+                    remainder -= height;
+                    ++quotient;
+                }
+            } else {
+                quotient -= quotientStep;
+                remainder -= remainderStep;
+                if (remainder < 0) {
+                    remainder += height;
+                    --quotient;
+                }
+            }
+        }
+    };
+
+    // Edges are stored as (1, 2), (2, 3), (3, 1) and truncate towards their first vertex.
+    EdgeWalker edgeBetween(const int (&xs)[3], const int (&ys)[3], int a, int b, long long row) const {
+        if (b != (a + 1) % 3) {
+            swap(a, b);
+        }
+        return EdgeWalker(xs[a], ys[a], xs[b], ys[b], row);
+    }
+
+    // Rows in [top, bottom) cross the long edge and exactly one short edge, so each row is
+    // a single span between two walkers. Nothing is allocated per row.
+    void scanlineAlgorithm(Canvas &canvas, char symbol) const {
+        const int xs[3] = {x1, x2, x3};
+        const int ys[3] = {y1, y2, y3};
+        int order[3] = {0, 1, 2};
+        sort(order, order + 3, [&ys](int a, int b) { return ys[a] < ys[b]; });
+        int top = order[0], middle = order[1], bottom = order[2];
+
+        long long firstRow = max<long long>(ys[top], canvas.clip.top);
+        long long lastRow = min<long long>(static_cast<long long>(ys[bottom]) - 1, canvas.clip.bottom);
+        if (firstRow > lastRow) {
+            return;
+        }
+
+        EdgeWalker longEdge = edgeBetween(xs, ys, top, bottom, firstRow);
+        EdgeWalker shortEdge = firstRow < ys[middle]
+                                   ? edgeBetween(xs, ys, top, middle, firstRow)
+                                   : edgeBetween(xs, ys, middle, bottom, firstRow);
+        for (long long y = firstRow; y <= lastRow; ++y) {
+            if (y == ys[middle] && y != firstRow) {
+                shortEdge = edgeBetween(xs, ys, middle, bottom, y);
+            }
+            long long a = longEdge.x(), b = shortEdge.x();
+            canvas.fillSpan(y, min(a, b), max(a, b), symbol);
+            longEdge.nextRow();
+            shortEdge.nextRow();
+        }
+    }
+
+
+    void drawLines(Canvas &canvas, char symbol) const {
+        Line::rasterize(canvas, x1, y1, x2, y2, true, symbol);
+        Line::rasterize(canvas, x2, y2, x3, y3, true, symbol);
+        Line::rasterize(canvas, x3, y3, x1, y1, true, symbol);
+    }
+
+    bool triangleEdges(int сx, int сy) const {
+        return Line::segmentContains(x1, y1, x2, y2, сx, сy) ||
+               Line::segmentContains(x2, y2, x3, y3, сx, сy) ||
+               Line::segmentContains(x3, y3, x1, y1, сx, сy);
+    }
+
+public:
+    Triangle(int x1, int y1, int x2, int y2, int x3, int y3, FillOption fillOption, string_view colorName)
+        : x1(x1), y1(y1), x2(x2), y2(y2), x3(x3), y3(y3), fillOption(fillOption) {
+        setColor(colorName);
+        customSymbol = getColorSymbol();
+    }
+
+    FillOption getFillOption() const {
+        return fillOption;
+    }
+
+    bool changeSymbol() const {
+        return change;
+    }
+
+    char getCustomSymbol() const {
+        return customSymbol;
+    }
+
+    void setCustomSymbol(char symbol) {
+        customSymbol = symbol;
+        change = true;
+    }
+
+    Bounds getBounds() const {
+        return {min({x1, x2, x3}), min({y1, y2, y3}), max({x1, x2, x3}), max({y1, y2, y3})};
+    }
+
+    // FILL accepts barycentric weights down to -0.2, which grows the triangle around
+    // its centroid. FRAME tests the point with its coordinates swapped, so its box is
+    // the transposed vertex box.
+    Bounds getHitBounds() const {
+        if (fillOption == FRAME) {
+            Bounds box = getBounds();
+            return {box.top, box.left, box.bottom, box.right};
+        }
+        const double xs[3] = {static_cast<double>(x1), static_cast<double>(x2), static_cast<double>(x3)};
+        const double ys[3] = {static_cast<double>(y1), static_cast<double>(y2), static_cast<double>(y3)};
+        double left = INFINITY, top = INFINITY, right = -INFINITY, bottom = -INFINITY;
+        for (int i = 0; i < 3; ++i) {
+            int j = (i + 1) % 3, k = (i + 2) % 3;
+            double px = 1.4 * xs[i] - 0.2 * xs[j] - 0.2 * xs[k];
+            double py = 1.4 * ys[i] - 0.2 * ys[j] - 0.2 * ys[k];
+            left = min(left, px);
+            right = max(right, px);
+            top = min(top, py);
+            bottom = max(bottom, py);
+        }
+        return {
+            static_cast<long long>(floor(left)) - 1, static_cast<long long>(floor(top)) - 1,
+            static_cast<long long>(ceil(right)) + 1, static_cast<long long>(ceil(bottom)) + 1
+        };
+    }
+
+    bool validBorder(const Board &board) const {
+        return getBounds().intersects(board.bounds());
+    }
+
+    // Moves the first vertex to (newX, newY); the others keep their offsets from it.
+    void moveTo(int newX, int newY) {
+        int deltaX = newX - x1, deltaY = newY - y1;
+        x1 = newX;
+        y1 = newY;
+        x2 += deltaX;
+        y2 += deltaY;
+        x3 += deltaX;
+        y3 += deltaY;
+    }
+
+    void draw(Canvas &canvas) {
+        char symbol;
+        if (change) {
+            symbol = customSymbol;
+        } else {
+            symbol = getColorSymbol();
+        }
+        drawLines(canvas, symbol);
+
+        if (fillOption == FILL) {
+            scanlineAlgorithm(canvas, symbol);
+        }
+    }
+
+    void print() const {
+        cout << "Triangle x1: " << x1 << " y1: " << y1 << " x2: " << x2 << " y2: " << y2 << " x3: " << x3 << " y3: " <<
+                y3 << " Fill option: " << fillOptionType(fillOption) << " Color: " << getColor() << endl;
+    }
+
+    string getType() const {
+        return "Triangle";
+    }
+
+    string getParams() const {
+        return to_string(x1) + ' ' + to_string(y1) + ' ' + to_string(x2) + ' ' + to_string(y2) + ' ' + to_string(x3) +
+               ' ' + to_string(y3);
+    }
+
+    ShapeKey getKey() const {
+        return {TRIANGLE, {x1, y1, x2, y2, x3, y3}};
+    }
+
+    bool coordinateContains(int cx, int cy) const {
+        if (fillOption == FILL) {
+            double divider = (y2 - y3) * (x1 - x3) + (x3 - x2) * (y1 - y3);
+            double lambda1 = ((y2 - y3) * (cx - x3) + (x3 - x2) * (cy - y3)) / divider;
+            double lambda2 = ((y3 - y1) * (cx - x3) + (x1 - x3) * (cy - y3)) / divider;
+            double lambda3 = 1 - lambda1 - lambda2;
+            return lambda1 >= -0.2 && lambda2 >= -0.2 && lambda3 >= -0.2;
+        } else if (fillOption == FRAME) {
+            return triangleEdges(cy, cx);
+        }
+        return false;
+    }
+};
+
+
+// A shape of any kind, stored by value. Every call is one std::visit over the four
+// kinds, a jump table whose targets the compiler sees and can inline, in place of a
+// virtual call through a separately allocated object.
+class AnyShape {
+private:
+    variant<Rectangle, Circle, Line, Triangle> shape;
+
+public:
+    template<typename Kind>
+    AnyShape(Kind kind) : shape(std::move(kind)) {
+    }
+
+    // The stored shape if it is a Kind, otherwise nullptr.
+    template<typename Kind>
+    Kind *as() {
+        return get_if<Kind>(&shape);
+    }
+
+    template<typename Visit>
+    decltype(auto) apply(Visit visit) {
+        return std::visit(visit, shape);
+    }
+
+    template<typename Visit>
+    decltype(auto) apply(Visit visit) const {
+        return std::visit(visit, shape);
+    }
+
+    void draw(Canvas &canvas) {
+        apply([&canvas](auto &kind) { kind.draw(canvas); });
+    }
+
+    void print() const {
+        apply([](const auto &kind) { kind.print(); });
+    }
+
+    string getType() const {
+        return apply([](const auto &kind) { return kind.getType(); });
+    }
+
+    string getParams() const {
+        return apply([](const auto &kind) { return kind.getParams(); });
+    }
+
+    ShapeKey getKey() const {
+        return apply([](const auto &kind) { return kind.getKey(); });
+    }
+
+    string getColor() const {
+        return apply([](const Shape &kind) { return kind.getColor(); });
+    }
+
+    void setColor(string_view color) {
+        apply([&color](Shape &kind) { kind.setColor(color); });
+    }
+
+    ColorId getColorId() const {
+        return apply([](const Shape &kind) { return kind.getColorId(); });
+    }
+
+    // The symbol edit gave a line or triangle, or 0 while it draws with its colour's.
+    char getCustomSymbol() const {
+        return apply([](const auto &kind) -> char {
+            using Kind = decay_t<decltype(kind)>;
+            if constexpr (is_same_v<Kind, Line> || is_same_v<Kind, Triangle>) {
+                return kind.changeSymbol() ? kind.getCustomSymbol() : 0;
+            } else {
+                return 0;
+            }
+        });
+    }
+
+    void setCustomSymbol(char symbol) {
+        apply([symbol](auto &kind) {
+            using Kind = decay_t<decltype(kind)>;
+            if constexpr (is_same_v<Kind, Line> || is_same_v<Kind, Triangle>) {
+                kind.setCustomSymbol(symbol);
+            }
+        });
+    }
+
+    // Cells the shape can draw into.
+    Bounds getBounds() const {
+        return apply([](const auto &kind) { return kind.getBounds(); });
+    }
+
+    // Cells coordinateContains can accept; wider than getBounds where the hit-test is
+    // more tolerant than the rasterizer.
+    Bounds getHitBounds() const {
+        return apply([](const auto &kind) { return kind.getHitBounds(); });
+    }
+
+    bool validBorder(const Board &board) const {
+        return apply([&board](const auto &kind) { return kind.validBorder(board); });
+    }
+
+    bool coordinateContains(int cx, int cy) const {
+        return apply([cx, cy](const auto &kind) { return kind.coordinateContains(cx, cy); });
+    }
+
+    void moveTo(int x, int y) {
+        apply([x, y](auto &kind) { kind.moveTo(x, y); });
+    }
+};
+
+
+// Uniform grid of CELL_SIZE x CELL_SIZE buckets over shape hit boxes. A shape whose box
+// would cover more than MAX_CELLS_PER_SHAPE buckets is kept in a short list that every
+// query scans instead. Query results are shape IDs in ascending order.
+class SpatialIndex {
+private:
+    static const int CELL_SHIFT = 5;
+    static const long long MAX_CELLS_PER_SHAPE = 4096;
+
+    unordered_map<long long, vector<int> > cells;
+    unordered_map<int, Bounds> entries;
+    vector<int> oversized;
+
+    static long long cellKey(long long column, long long row) {
+        return static_cast<long long>(static_cast<unsigned long long>(column) << 32 ^
+                                      static_cast<unsigned long long>(row & 0xffffffffLL));
+    }
+
+    static long long cellCount(const Bounds &box) {
+        long long columns = (box.right >> CELL_SHIFT) - (box.left >> CELL_SHIFT) + 1;
+        long long rows = (box.bottom >> CELL_SHIFT) - (box.top >> CELL_SHIFT) + 1;
+        return columns > MAX_CELLS_PER_SHAPE || rows > MAX_CELLS_PER_SHAPE ? MAX_CELLS_PER_SHAPE + 1 : columns * rows;
+    }
+
+    template<typename Visit>
+    static void forEachCell(const Bounds &box, Visit visit) {
+        for (long long row = box.top >> CELL_SHIFT; row <= box.bottom >> CELL_SHIFT; ++row) {
+            for (long long column = box.left >> CELL_SHIFT; column <= box.right >> CELL_SHIFT; ++column) {
+                visit(cellKey(column, row));
+            }
+        }
+    }
+
+public:
+    void insert(int id, const Bounds &box) {
+        entries[id] = box;
+        if (box.empty()) {
+            return;
+        }
+        if (cellCount(box) > MAX_CELLS_PER_SHAPE) {
+            oversized.push_back(id);
+            return;
+        }
+        forEachCell(box, [this, id](long long key) { cells[key].push_back(id); });
+    }
+
+    void remove(int id) {
+        auto entry = entries.find(id);
+        if (entry == entries.end()) {
+            return;
+        }
+        const Bounds box = entry->second;
+        entries.erase(entry);
+        if (box.empty()) {
+            return;
+        }
+        if (cellCount(box) > MAX_CELLS_PER_SHAPE) {
+            oversized.erase(std::remove(oversized.begin(), oversized.end(), id), oversized.end());
+            return;
+        }
+        forEachCell(box, [this, id](long long key) {
+            auto cell = cells.find(key);
+            vector<int> &ids = cell->second;
+            ids.erase(std::remove(ids.begin(), ids.end(), id), ids.end());
+            if (ids.empty()) {
+                cells.erase(cell);
+            }
+        });
+    }
+
+    void update(int id, const Bounds &box) {
+        remove(id);
+        insert(id, box);
+    }
+
+    void reserve(size_t count) {
+        entries.reserve(count);
+    }
+
+    void clear() {
+        cells.clear();
+        entries.clear();
+        oversized.clear();
+    }
+
+    vector<int> queryPoint(long long x, long long y) const {
+        vector<int> found;
+        auto cell = cells.find(cellKey(x >> CELL_SHIFT, y >> CELL_SHIFT));
+        if (cell != cells.end()) {
+            for (int id: cell->second) {
+                if (entries.at(id).contains(x, y)) {
+                    found.push_back(id);
+                }
+            }
+        }
+        for (int id: oversized) {
+            if (entries.at(id).contains(x, y)) {
+                found.push_back(id);
+            }
+        }
+        sort(found.begin(), found.end());
+        return found;
+    }
+
+    vector<int> queryRegion(const Bounds &region) const {
+        vector<int> found;
+        if (cellCount(region) > static_cast<long long>(entries.size())) {
+            for (const auto &entry: entries) {
+                if (entry.second.intersects(region)) {
+                    found.push_back(entry.first);
+                }
+            }
+            sort(found.begin(), found.end());
+            return found;
+        }
+        forEachCell(region, [this, &region, &found](long long key) {
+            auto cell = cells.find(key);
+            if (cell == cells.end()) {
+                return;
+            }
+            for (int id: cell->second) {
+                if (entries.at(id).intersects(region)) {
+                    found.push_back(id);
+                }
+            }
+        });
+        for (int id: oversized) {
+            if (entries.at(id).intersects(region)) {
+                found.push_back(id);
+            }
+        }
+        sort(found.begin(), found.end());
+        found.erase(unique(found.begin(), found.end()), found.end());
+        return found;
+    }
+};
+
+// Refers to a stored shape without owning it. It goes stale once that shape is removed,
+// even if its ID is handed out again later.
+struct ShapeHandle {
+    int id = 0;
+    unsigned generation = 0;
+};
+
+// Generational slot map keyed by shape ID. Shapes sit by value in one contiguous array
+// in insertion order (which is also ID order), and each ID's slot points into it.
+// Removal leaves a hole, marked by ID 0, that iteration skips; the array is compacted
+// once holes outnumber shapes.
+class ShapeStore {
+private:
+    struct Slot {
+        unsigned generation = 0;
+        int dense = -1;
+    };
+
+    vector<Slot> slots;
+    vector<int> denseIds;
+    vector<AnyShape> dense;
+    size_t live = 0;
+
+    void compact() {
+        size_t kept = 0;
+        for (size_t i = 0; i < dense.size(); ++i) {
+            if (denseIds[i] != 0) {
+                if (kept != i) {
+                    dense[kept] = std::move(dense[i]);
+                }
+                denseIds[kept] = denseIds[i];
+                slots[denseIds[kept]].dense = static_cast<int>(kept);
+                ++kept;
+            }
+        }
+        dense.erase(dense.begin() + kept, dense.end());
+        denseIds.resize(kept);
+    }
+
+public:
+    bool empty() const {
+        return live == 0;
+    }
+
+    size_t size() const {
+        return live;
+    }
+
+    void reserve(size_t count) {
+        dense.reserve(count);
+        denseIds.reserve(count);
+    }
+
+    void insert(int id, AnyShape shape) {
+        if (static_cast<size_t>(id) >= slots.size()) {
+            slots.resize(id + 1);
+        }
+        slots[id].dense = static_cast<int>(dense.size());
+        dense.push_back(std::move(shape));
+        denseIds.push_back(id);
+        ++live;
+    }
+
+    bool erase(int id) {
+        if (!find(id)) {
+            return false;
+        }
+        Slot &slot = slots[id];
+        denseIds[slot.dense] = 0;
+        slot.dense = -1;
+        ++slot.generation;
+        --live;
+        if (dense.size() - live > max<size_t>(live, 64)) {
+            compact();
+        }
+        return true;
+    }
+
+    void clear() {
+        for (Slot &slot: slots) {
+            if (slot.dense != -1) {
+                slot.dense = -1;
+                ++slot.generation;
+            }
+        }
+        dense.clear();
+        denseIds.clear();
+        live = 0;
+    }
+
+    AnyShape *find(int id) {
+        if (id <= 0 || static_cast<size_t>(id) >= slots.size() || slots[id].dense == -1) {
+            return nullptr;
+        }
+        return &dense[slots[id].dense];
+    }
+
+    const AnyShape *find(int id) const {
+        return const_cast<ShapeStore *>(this)->find(id);
+    }
+
+    AnyShape *find(const ShapeHandle &handle) {
+        AnyShape *shape = find(handle.id);
+        return shape && slots[handle.id].generation == handle.generation ? shape : nullptr;
+    }
+
+    ShapeHandle handle(int id) const {
+        return {id, slots[id].generation};
+    }
+
+    // Calls visit(id, shape) for every stored shape in insertion order.
+    template<typename Visit>
+    void forEach(Visit visit) {
+        for (size_t i = 0; i < dense.size(); ++i) {
+            if (denseIds[i] != 0) {
+                visit(denseIds[i], dense[i]);
+            }
+        }
+    }
+
+    template<typename Visit>
+    void forEach(Visit visit) const {
+        for (size_t i = 0; i < dense.size(); ++i) {
+            if (denseIds[i] != 0) {
+                visit(denseIds[i], dense[i]);
+            }
+        }
+    }
+};
+
+// Rasterized spans of each shape, kept relative to the top-left corner of its bounds.
+// Rasterization is translation-invariant, so a moved shape is redrawn by replaying its
+// spans at the new corner. Only shapes lying wholly inside the canvas clip are
+// recorded, which keeps the spans unclipped; replay clips them like any other write.
+// Spans of all shapes share one arena, indexed by shape ID, so a frame replays them in
+// storage order. At most MAX_SPANS live spans are kept; past that, and for shapes with
+// more than MAX_SPANS_PER_SHAPE spans, shapes are drawn without caching.
+class RasterCache {
+public:
+    // What one thread recorded during a frame. Drawing only reads the cache, so tiles
+    // can draw concurrently, each thread into its own batch; commit files them after.
+    struct Batch {
+        Recording scratch;
+        vector<int> ids;
+        vector<unsigned> counts;
+        vector<char> symbols;
+        vector<Span> spans;
+        unsigned long long hits = 0, misses = 0;
+    };
+
+private:
+    static const size_t MAX_SPANS = 1 << 21;
+    static const size_t MAX_SPANS_PER_SHAPE = 1 << 14;
+
+    enum EntryState : unsigned char { EMPTY, CACHED, TOO_LARGE };
+
+    struct Entry {
+        unsigned offset = 0;
+        unsigned count = 0;
+        char symbol = ' ';
+        EntryState state = EMPTY;
+    };
+
+    vector<Entry> entries;
+    vector<Span> arena;
+    size_t liveSpans = 0;
+    size_t cachedShapes = 0;
+    unsigned long long hits = 0, misses = 0;
+
+    // Drops the spans of invalidated shapes once they outnumber the live ones.
+    void compact() {
+        vector<Span> kept;
+        kept.reserve(liveSpans);
+        for (Entry &entry: entries) {
+            if (entry.state == CACHED) {
+                unsigned offset = static_cast<unsigned>(kept.size());
+                kept.insert(kept.end(), arena.begin() + entry.offset, arena.begin() + entry.offset + entry.count);
+                entry.offset = offset;
+            }
+        }
+        arena.swap(kept);
+    }
+
+public:
+    template<typename Kind>
+    void draw(int id, Kind &shape, const Bounds &box, Canvas &canvas, Batch &batch) const {
+        EntryState state = static_cast<size_t>(id) < entries.size() ? entries[id].state : EMPTY;
+        if (state == CACHED) {
+            const Entry &entry = entries[id];
+            ++batch.hits;
+            const Span *span = arena.data() + entry.offset, *end = span + entry.count;
+            if (canvas.clip.contains(box)) {
+                for (; span != end; ++span) {
+                    canvas.plotSpan(box.top + span->y, box.left + span->x1, box.left + span->x2, entry.symbol);
+                }
+            } else {
+                for (; span != end; ++span) {
+                    canvas.fillSpan(box.top + span->y, box.left + span->x1, box.left + span->x2, entry.symbol);
+                }
+            }
+            return;
+        }
+        if (state == TOO_LARGE) {
+            shape.draw(canvas);
+            return;
+        }
+        ++batch.misses;
+        if (liveSpans + batch.spans.size() + MAX_SPANS_PER_SHAPE > MAX_SPANS || !canvas.clip.contains(box)) {
+            shape.draw(canvas);
+            return;
+        }
+        batch.scratch.spans.clear();
+        canvas.recording = &batch.scratch;
+        shape.draw(canvas);
+        canvas.recording = nullptr;
+        size_t count = batch.scratch.spans.size();
+        batch.ids.push_back(id);
+        batch.counts.push_back(static_cast<unsigned>(count));
+        batch.symbols.push_back(batch.scratch.symbol);
+        if (count > MAX_SPANS_PER_SHAPE) {
+            return;
+        }
+        for (const Span &span: batch.scratch.spans) {
+            batch.spans.push_back({
+                span.y - static_cast<int>(box.top), span.x1 - static_cast<int>(box.left),
+                span.x2 - static_cast<int>(box.left)
+            });
+        }
+    }
+
+    // Files the recordings of batch and empties it. A shape recorded twice in one frame
+    // keeps its first recording.
+    void commit(Batch &batch) {
+        hits += batch.hits;
+        misses += batch.misses;
+        const Span *spans = batch.spans.data();
+        for (size_t i = 0; i < batch.ids.size(); ++i) {
+            int id = batch.ids[i];
+            size_t count = batch.counts[i];
+            if (static_cast<size_t>(id) >= entries.size()) {
+                entries.resize(id + 1);
+            }
+            Entry &entry = entries[id];
+            bool fits = count <= MAX_SPANS_PER_SHAPE;
+            if (entry.state == EMPTY && !fits) {
+                entry.state = TOO_LARGE;
+            } else if (entry.state == EMPTY && liveSpans + count <= MAX_SPANS) {
+                entry.state = CACHED;
+                entry.offset = static_cast<unsigned>(arena.size());
+                entry.count = static_cast<unsigned>(count);
+                entry.symbol = batch.symbols[i];
+                arena.insert(arena.end(), spans, spans + count);
+                liveSpans += count;
+                ++cachedShapes;
+            }
+            if (fits) {
+                spans += count;
+            }
+        }
+        batch.ids.clear();
+        batch.counts.clear();
+        batch.symbols.clear();
+        batch.spans.clear();
+        batch.hits = batch.misses = 0;
+    }
+
+    void invalidate(int id) {
+        if (static_cast<size_t>(id) >= entries.size() || entries[id].state == EMPTY) {
+            return;
+        }
+        if (entries[id].state == CACHED) {
+            liveSpans -= entries[id].count;
+            --cachedShapes;
+        }
+        entries[id] = Entry();
+        if (arena.size() - liveSpans > max<size_t>(liveSpans, 4096)) {
+            compact();
+        }
+    }
+
+    void clear() {
+        entries.clear();
+        arena.clear();
+        liveSpans = 0;
+        cachedShapes = 0;
+    }
+
+    void printStats() const {
+        cout << "Raster cache: " << cachedShapes << " shapes, " << liveSpans << " spans, "
+                << arena.capacity() * sizeof(Span) + entries.capacity() * sizeof(Entry) << " bytes (limit "
+                << MAX_SPANS << " spans), " << hits << " hits, " << misses << " misses" << endl;
+    }
+};
+
+// Fixed set of worker threads that run one job of numbered tasks at a time. The
+// calling thread works on the job too, as worker 0, and run returns once every task
+// is done. Each worker starts with a contiguous share of the tasks in its own deque and
+// takes from the back of it; once that is empty it steals from the front of the
+// others', so a few slow tasks do not leave the rest of the threads idle.
+class ThreadPool {
+private:
+    // One per thread, each on its own cache line. The counters are written only by
+    // the worker itself, while a job runs.
+    struct alignas(CACHE_LINE) Worker {
+        mutex lock;
+        deque<size_t> tasks;
+        unsigned long long tasksRun = 0;
+        unsigned long long tasksStolen = 0;
+        chrono::steady_clock::duration busy{};
+    };
+
+    size_t workerCount;
+    unique_ptr<Worker[]> queues;
+    vector<thread> workers;
+    mutex lock;
+    condition_variable wake, finished;
+    function<void(size_t, size_t)> job;
+    unsigned long long generation = 0;
+    size_t busy = 0;
+    bool stopping = false;
+    unsigned long long jobs = 0;
+    chrono::steady_clock::duration elapsed{};
+
+    // No task adds others, so once every deque is found empty the job is done.
+    bool take(size_t worker, size_t &task) {
+        Worker &own = queues[worker];
+        {
+            lock_guard<mutex> guard(own.lock);
+            if (!own.tasks.empty()) {
+                task = own.tasks.back();
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+        for (size_t step = 1; step < workerCount; ++step) {
+            Worker &victim = queues[(worker + step) % workerCount];
+            lock_guard<mutex> guard(victim.lock);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.front();
+                victim.tasks.pop_front();
+                ++own.tasksStolen;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void work(size_t worker) {
+        Worker &own = queues[worker];
+        size_t task;
+        while (take(worker, task)) {
+            auto start = chrono::steady_clock::now();
+            job(task, worker);
+            own.busy += chrono::steady_clock::now() - start;
+            ++own.tasksRun;
+        }
+    }
+
+    void workerLoop(size_t worker) {
+        unsigned long long seen = 0;
+        while (true) {
+            {
+                unique_lock<mutex> guard(lock);
+                wake.wait(guard, [this, seen] { return stopping || generation != seen; });
+                if (stopping) {
+                    return;
+                }
+                seen = generation;
+            }
+            work(worker);
+            lock_guard<mutex> guard(lock);
+            if (--busy == 0) {
+                finished.notify_one();
+            }
+        }
+    }
+
+public:
+    explicit ThreadPool(size_t threads) : workerCount(threads), queues(new Worker[threads]) {
+        for (size_t worker = 1; worker < threads; ++worker) {
+            workers.emplace_back(&ThreadPool::workerLoop, this, worker);
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            lock_guard<mutex> guard(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (thread &worker: workers) {
+            worker.join();
+        }
+    }
+
+    size_t size() const {
+        return workerCount;
+    }
+
+    // Calls task(index, worker) for every index below tasks.
+    void run(size_t tasks, function<void(size_t, size_t)> task) {
+        auto start = chrono::steady_clock::now();
+        job = std::move(task);
+        for (size_t worker = 0; worker < workerCount; ++worker) {
+            lock_guard<mutex> guard(queues[worker].lock);
+            for (size_t index = tasks * worker / workerCount; index < tasks * (worker + 1) / workerCount; ++index) {
+                queues[worker].tasks.push_back(index);
+            }
+        }
+        if (!workers.empty()) {
+            {
+                lock_guard<mutex> guard(lock);
+                busy = workers.size();
+                ++generation;
+            }
+            wake.notify_all();
+        }
+        work(0);
+        if (!workers.empty()) {
+            unique_lock<mutex> guard(lock);
+            finished.wait(guard, [this] { return busy == 0; });
+        }
+        elapsed += chrono::steady_clock::now() - start;
+        ++jobs;
+    }
+
+    // Utilization is the share of the time spent in run that each worker spent inside tasks.
+    void printStats() const {
+        if (jobs == 0) {
+            return;
+        }
+        cout << "Thread pool: " << jobs << " jobs in " << chrono::duration<double, milli>(elapsed).count() << " ms"
+                << endl;
+        for (size_t worker = 0; worker < workerCount; ++worker) {
+            const Worker &stats = queues[worker];
+            cout << "  Worker " << worker << ": " << stats.tasksRun << " tasks (" << stats.tasksStolen << " stolen), "
+                    << 100.0 * stats.busy.count() / max<long long>(1, elapsed.count()) << "% busy" << endl;
+        }
+    }
+};
+
+class ShapeCommands {
+public:
+    // IDs added by one command: a single add, or a whole load.
+    struct IdRange {
+        int firstId;
+        int count;
+    };
+
+private:
+    Board board;
+    ShapeStore shapes;
+    int ID = 1;
+    stack<IdRange> shapeStack;
+    ShapeHandle select;
+    SpatialIndex spatialIndex;
+    RasterCache rasterCache;
+    bool ownersValid = false;
+    // Board areas that no longer match the shapes. Once there are more than MAX_DIRTY of
+    // them, or something changed the whole board, fullRedraw is set instead.
+    vector<Bounds> dirtyRegions;
+    bool fullRedraw = true;
+    static const size_t MAX_DIRTY = 64;
+    // Full redraws with more than one thread split the board into TILE_SIZE squares.
+    // Tiles are a whole number of cache lines wide, so threads never write to the same
+    // line of cells. Each tile gathers its shapes from all over the store, so tiles are
+    // kept large enough for that gather not to dominate.
+    static constexpr int TILE_SIZE = 256;
+    unique_ptr<ThreadPool> pool = make_unique<ThreadPool>(1);
+    vector<RasterCache::Batch> batches = vector<RasterCache::Batch>(1);
+
+    // A tile's shape in its bin, with the cells its box covers there as a cost estimate.
+    struct BinEntry {
+        int id;
+        unsigned cost;
+        AnyShape *shape;
+    };
+
+    // Shapes [begin, end) of a tile's bin. Layer 0 draws into the board; the tile's other
+    // slices draw into their own layer, merged over the board in slice order afterwards.
+    struct TileTask {
+        size_t tile;
+        size_t begin, end;
+        size_t layer;
+    };
+
+    struct TileMerge {
+        size_t tile;
+        size_t firstLayer, layerCount;
+    };
+
+    // Tile-sized cells and owners; an owner of 0 marks a cell no shape in the slice drew.
+    struct Layer {
+        vector<char> cells;
+        vector<int> owners;
+    };
+
+    // Every shape costs at least this much to draw in a tile, however few cells it covers.
+    static const unsigned SHAPE_COST = 64;
+    vector<vector<BinEntry> > tileBins;
+    vector<long long> tileCosts;
+    vector<TileTask> tileTasks;
+    vector<TileMerge> tileMerges;
+    vector<Layer> layers;
+    // How many stored shapes have each key; move and edit can make two shapes equal.
+    unordered_map<ShapeKey, int, ShapeKeyHash> shapeKeys;
+
+    void rememberKey(const AnyShape &shape) {
+        ++shapeKeys[shape.getKey()];
+    }
+
+    void forgetKey(const AnyShape &shape) {
+        auto key = shapeKeys.find(shape.getKey());
+        if (key != shapeKeys.end() && --key->second == 0) {
+            shapeKeys.erase(key);
+        }
+    }
+
+    // The index answers both hit-tests and redraws, so it holds the union of the hit
+    // box and the drawn box.
+    static Bounds indexBounds(const AnyShape &shape) {
+        return shape.getHitBounds().united(shape.getBounds());
+    }
+
+    void markDirty(const Bounds &region) {
+        ownersValid = false;
+        if (fullRedraw || !region.intersects(board.bounds())) {
+            return;
+        }
+        if (dirtyRegions.size() == MAX_DIRTY) {
+            fullRedraw = true;
+            dirtyRegions.clear();
+            return;
+        }
+        dirtyRegions.push_back(region);
+    }
+
+    void markAllDirty() {
+        ownersValid = false;
+        fullRedraw = true;
+        dirtyRegions.clear();
+    }
+
+    void drawShape(int id, AnyShape &shape, Canvas &canvas, RasterCache::Batch &batch) const {
+        shape.apply([this, &canvas, &batch, id](auto &kind) {
+            Bounds box = kind.getBounds();
+            if (box.intersects(canvas.clip)) {
+                canvas.pen = id;
+                rasterCache.draw(id, kind, box, canvas, batch);
+            }
+        });
+    }
+
+    // Clears region and re-composites, in ID order, only the shapes the index finds
+    // over it, with every write clipped to region.
+    void redrawRegion(const Bounds &region) {
+        Canvas canvas = board.canvas(region);
+        if (canvas.clip.empty()) {
+            return;
+        }
+        const Bounds &clip = canvas.clip;
+        canvas.fillRect(clip.left, clip.top, clip.right, clip.bottom, ' ');
+        for (int id: spatialIndex.queryRegion(clip)) {
+            drawShape(id, *shapes.find(id), canvas, batches[0]);
+        }
+    }
+
+    Bounds tileBounds(size_t tile, int columns) const {
+        long long left = static_cast<long long>(tile % columns) * TILE_SIZE;
+        long long top = static_cast<long long>(tile / columns) * TILE_SIZE;
+        return {left, top, left + TILE_SIZE - 1, top + TILE_SIZE - 1};
+    }
+
+    // Splits each tile's bin into tasks. A tile costing much more than its share of the
+    // frame is cut into up to one slice per thread, of about equal cost, so its shapes
+    // are drawn in parallel too; below a few tile areas a slice does not pay for
+    // clearing and merging its layer.
+    void planTileTasks() {
+        tileTasks.clear();
+        tileMerges.clear();
+        long long total = 0;
+        for (long long cost: tileCosts) {
+            total += cost;
+        }
+        size_t threads = pool->size();
+        long long slice = max(total / static_cast<long long>(threads * 4), 4LL * TILE_SIZE * TILE_SIZE);
+        size_t layerCount = 0;
+        for (size_t tile = 0; tile < tileBins.size(); ++tile) {
+            const vector<BinEntry> &bin = tileBins[tile];
+            size_t pieces = static_cast<size_t>(min<long long>(threads, (tileCosts[tile] + slice - 1) / slice));
+            if (pieces <= 1 || bin.size() < 2) {
+                tileTasks.push_back({tile, 0, bin.size(), 0});
+                continue;
+            }
+            long long target = tileCosts[tile] / static_cast<long long>(pieces);
+            size_t firstLayer = layerCount;
+            size_t begin = 0, slices = 0;
+            long long cost = 0;
+            for (size_t index = 0; index + 1 < bin.size() && slices + 1 < pieces; ++index) {
+                cost += bin[index].cost;
+                if (cost >= target) {
+                    tileTasks.push_back({tile, begin, index + 1, slices++ == 0 ? 0 : ++layerCount});
+                    begin = index + 1;
+                    cost = 0;
+                }
+            }
+            tileTasks.push_back({tile, begin, bin.size(), slices == 0 ? 0 : ++layerCount});
+            if (layerCount > firstLayer) {
+                tileMerges.push_back({tile, firstLayer, layerCount - firstLayer});
+            }
+        }
+        if (layers.size() < layerCount) {
+            layers.resize(layerCount);
+            for (Layer &layer: layers) {
+                layer.cells.resize(static_cast<size_t>(TILE_SIZE) * TILE_SIZE);
+                layer.owners.resize(static_cast<size_t>(TILE_SIZE) * TILE_SIZE);
+            }
+        }
+    }
+
+    // Bins every visible shape, in ID order, into the tiles its box overlaps, then lets
+    // the pool clear and draw the tiles. Each cell is written only by its own tile, in the
+    // same order as a serial redraw, so the result is identical. A split tile's later
+    // slices only reach the board through the merge, which also keeps that order.
+    void redrawTiles() {
+        int columns = (board.width + TILE_SIZE - 1) / TILE_SIZE;
+        int rows = (board.height + TILE_SIZE - 1) / TILE_SIZE;
+        tileBins.resize(static_cast<size_t>(columns) * rows);
+        for (auto &bin: tileBins) {
+            bin.clear();
+        }
+        tileCosts.assign(tileBins.size(), 0);
+        Bounds viewport = board.bounds();
+        shapes.forEach([this, &viewport, columns](int id, AnyShape &shape) {
+            Bounds box = shape.getBounds().intersection(viewport);
+            if (box.empty()) {
+                return;
+            }
+            for (long long row = box.top / TILE_SIZE; row <= box.bottom / TILE_SIZE; ++row) {
+                for (long long column = box.left / TILE_SIZE; column <= box.right / TILE_SIZE; ++column) {
+                    size_t tile = row * columns + column;
+                    Bounds covered = box.intersection(tileBounds(tile, columns));
+                    unsigned cost = SHAPE_COST + static_cast<unsigned>((covered.right - covered.left + 1) *
+                                                                       (covered.bottom - covered.top + 1));
+                    tileBins[tile].push_back({id, cost, &shape});
+                    tileCosts[tile] += cost;
+                }
+            }
+        });
+        planTileTasks();
+        pool->run(tileTasks.size(), [this, columns](size_t index, size_t worker) {
+            const TileTask &task = tileTasks[index];
+            Bounds tile = tileBounds(task.tile, columns);
+            Canvas canvas = board.canvas(tile);
+            if (task.layer == 0) {
+                const Bounds &clip = canvas.clip;
+                canvas.fillRect(clip.left, clip.top, clip.right, clip.bottom, ' ');
+            } else {
+                Layer &layer = layers[task.layer - 1];
+                fill(layer.owners.begin(), layer.owners.end(), 0);
+                canvas.cells = layer.cells.data();
+                canvas.owners = layer.owners.data();
+                canvas.stride = TILE_SIZE;
+                canvas.origin = static_cast<size_t>(tile.top) * TILE_SIZE + tile.left;
+            }
+            const vector<BinEntry> &bin = tileBins[task.tile];
+            for (size_t entry = task.begin; entry < task.end; ++entry) {
+                drawShape(bin[entry].id, *bin[entry].shape, canvas, batches[worker]);
+            }
+        });
+        pool->run(tileMerges.size(), [this, columns](size_t index, size_t) {
+            const TileMerge &merge = tileMerges[index];
+            Bounds tile = tileBounds(merge.tile, columns);
+            Canvas canvas = board.canvas(tile);
+            const Bounds &clip = canvas.clip;
+            for (size_t layer = merge.firstLayer; layer < merge.firstLayer + merge.layerCount; ++layer) {
+                const Layer &slice = layers[layer];
+                for (long long y = clip.top; y <= clip.bottom; ++y) {
+                    size_t row = static_cast<size_t>(y - tile.top) * TILE_SIZE - tile.left;
+                    for (long long x = clip.left; x <= clip.right; ++x) {
+                        if (int owner = slice.owners[row + x]) {
+                            canvas.pen = owner;
+                            canvas.plot(x, y, slice.cells[row + x]);
+                        }
+                    }
+                }
+            }
+        });
+    }
+
+    // Brings the board up to date with the shapes: everything when fullRedraw is set,
+    // otherwise just the dirty regions. With picking on, the board's owner buffer ends up
+    // holding the topmost shape ID of each cell.
+    void renderScene() {
+        if (fullRedraw && pool->size() > 1) {
+            redrawTiles();
+        } else if (fullRedraw) {
+            board.clear();
+            Canvas canvas = board.canvas(board.bounds());
+            shapes.forEach([this, &canvas](int id, AnyShape &shape) {
+                drawShape(id, shape, canvas, batches[0]);
+            });
+        } else {
+            for (const Bounds &region: dirtyRegions) {
+                redrawRegion(region);
+            }
+        }
+        for (auto &batch: batches) {
+            rasterCache.commit(batch);
+        }
+        dirtyRegions.clear();
+        fullRedraw = false;
+        ownersValid = board.ownersEnabled();
+    }
+
+    // Call after the shape changed; its old box must have been marked dirty before.
+    void reindex(int id, const AnyShape &changed) {
+        markDirty(changed.getBounds());
+        spatialIndex.update(id, indexBounds(changed));
+    }
+
+    // Stores the shape under the next ID unless it duplicates another or leaves the board,
+    // which is reported instead. Undo is up to the caller.
+    bool insertShape(AnyShape shape) {
+        if (shapeKeys.count(shape.getKey()) != 0) {
+            cout << "Shape " << shape.getType() << " with params " << shape.getParams() << " already exists." <<
+                    endl;
+            return false;
+        }
+        if (!shape.validBorder(board)) {
+            cout << "Shape outside of the board." << endl;
+            return false;
+        }
+        rememberKey(shape);
+        spatialIndex.insert(ID, indexBounds(shape));
+        markDirty(shape.getBounds());
+        shapes.insert(ID, std::move(shape));
+        ID++;
+        return true;
+    }
+
+    // Drops the cached spans and the drawn cells of a shape about to change in place.
+    void beginEdit(int id, const AnyShape &shape) {
+        rasterCache.invalidate(id);
+        markDirty(shape.getBounds());
+    }
 
-class ShapeCommands {
-private:
-    Board board;
-    map<int, shared_ptr<Shape> > shapes;
-    int ID = 1;
-    stack<int> shapeStack;
-    weak_ptr<Shape> select;
+    // Moves the shape by its first point without printing anything.
+    void relocate(int id, AnyShape &shape, int x, int y) {
+        forgetKey(shape);
+        markDirty(shape.getBounds());
+        shape.moveTo(x, y);
+        rememberKey(shape);
+        reindex(id, shape);
+    }
 
 public:
+    ShapeCommands(int width = DEFAULT_BOARD_WIDTH, int height = DEFAULT_BOARD_HEIGHT) : board(width, height) {
+    }
+
     void listShapes() const {
         if (shapes.empty()) {
             cout << "No shapes added." << endl;
             return;
         }
-        for (const auto &shape: shapes) {
-            cout << "ID: " << shape.first << ", ";
-            shape.second->print();
-        }
+        shapes.forEach([](int id, const AnyShape &shape) {
+            cout << "ID: " << id << ", ";
+            shape.print();
+        });
     }
 
     void allShapes() const {
@@ -617,74 +2429,313 @@ public:
                 << "Line: x1, y1, x2, y2 " << endl;
     }
 
-    void addShape(shared_ptr<Shape> shape) {
-        for (const auto &newShape: shapes) {
-            if (newShape.second->getType() == shape->getType() && newShape.second->getParams() == shape->getParams()) {
-                cout << "Shape " << shape->getType() << " with params " << shape->getParams() << " already exists." <<
-                        endl;
-                return;
-            }
+    void addShape(AnyShape shape) {
+        if (insertShape(std::move(shape))) {
+            shapeStack.push({ID - 1, 1});
         }
-        if (!shape->validBorder()) {
-            cout << "Shape outside of the board." << endl;
+    }
+
+    // Adds the shapes in order, with addShape's checks and messages, as one undo step.
+    // With joinLastUndo set, the step an earlier call opened grows instead, so a load
+    // added in several batches is undone at once.
+    void addShapes(vector<AnyShape> &batch, bool joinLastUndo = false) {
+        if (batch.size() > MAX_DIRTY) {
+            markAllDirty();
+        }
+        int firstId = ID;
+        for (AnyShape &shape: batch) {
+            insertShape(std::move(shape));
+        }
+        int count = ID - firstId;
+        if (count == 0) {
             return;
         }
-        shapes[ID] = shape;
-        shapeStack.push(ID);
-        ID++;
+        if (joinLastUndo && !shapeStack.empty() && shapeStack.top().firstId + shapeStack.top().count == firstId) {
+            shapeStack.top().count += count;
+        } else {
+            shapeStack.push({firstId, count});
+        }
+    }
+
+    // Makes room for count shapes in all, so a bulk add does not grow the store and its
+    // hash tables step by step.
+    void reserveShapes(size_t count) {
+        shapes.reserve(count);
+        shapeKeys.reserve(count);
+        spatialIndex.reserve(count);
     }
 
     void drawBoard() {
-        board.clear();
-        if (!shapes.empty()) {
-            for (const auto &shape: shapes) {
-                shape.second->draw(board.grid);
+        renderScene();
+        board.print();
+    }
+
+    // Fills a scratch scene of this board's size with up to count random shapes (fixed
+    // seed, so runs are comparable) and times full redraws on 1 to maxThreads threads,
+    // then a one-shape move. A skewed scene packs most shapes into the top left tile and
+    // adds a few board-sized fills.
+    void benchmark(int count, int maxThreads, bool skewed = false) const {
+        if (count <= 0 || maxThreads <= 0) {
+            throw invalid_argument("Benchmark needs a positive shape count and thread count.");
+        }
+        ShapeCommands scratch(board.width, board.height);
+        scratch.board.setDifferential(false);
+        scratch.shapes.reserve(count);
+        mt19937 random(42);
+        auto coordinate = [&random](int limit) { return uniform_int_distribution<int>(0, limit - 1)(random); };
+        auto extent = [&random](int limit) { return uniform_int_distribution<int>(1, limit)(random); };
+        const char *colorNames[] = {"red", "green", "yellow", "blue", "magenta", "cyan", "white"};
+        int w = board.width, h = board.height;
+        long long attempts = 0;
+        while (scratch.shapes.size() < static_cast<size_t>(count) && attempts++ < count * 4LL + 1000) {
+            string color = colorNames[attempts % 7];
+            FillOption fill = attempts % 3 == 0 ? FRAME : FILL;
+            bool clustered = skewed && attempts % 8 != 0;
+            int x = coordinate(clustered ? min(w, TILE_SIZE) : w), y = coordinate(clustered ? min(h, TILE_SIZE) : h);
+            AnyShape shape = Line(x, y, x, y, false, color);
+            switch (attempts % 4) {
+                case 0:
+                    shape = Rectangle(x, y, extent(16), extent(32), fill, color);
+                    break;
+                case 1:
+                    shape = Circle(x, y, extent(max(1, min(12, min(w, h) / 2))), fill, color);
+                    break;
+                case 2:
+                    shape = Line(x, y, x + extent(40) - 20, y + extent(20) - 10, false, color);
+                    break;
+                default:
+                    shape = Triangle(x, y, x + extent(30) - 15, y + extent(16), x + extent(30) - 15, y + extent(16),
+                                     fill, color);
+                    break;
+            }
+            if (skewed && attempts % 5000 == 0) {
+                if (attempts % 10000 == 0) {
+                    shape = Rectangle(coordinate(w / 4 + 1), coordinate(h / 4 + 1), h / 2, w / 2, FILL, color);
+                } else {
+                    shape = Triangle(coordinate(w), 0, 0, h - 1, w - 1, coordinate(h), FILL, color);
+                }
+            }
+            if (scratch.shapeKeys.count(shape.getKey()) == 0 && shape.validBorder(scratch.board)) {
+                scratch.addShape(std::move(shape));
             }
         }
-        board.print();
+
+        // The first frame fills the raster cache; each thread count is then timed on
+        // cached frames and its board compared with the single-threaded one.
+        const int runs = 5;
+        auto fullFrame = [&scratch] {
+            scratch.markAllDirty();
+            auto start = chrono::steady_clock::now();
+            scratch.renderScene();
+            return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+        };
+        auto boardCells = [&scratch] {
+            string cells;
+            for (int y = 0; y < scratch.board.height; ++y) {
+                cells.append(scratch.board.row(y), scratch.board.width);
+            }
+            return cells;
+        };
+        double first = fullFrame();
+        cout << "Rendered " << scratch.shapes.size() << " shapes on " << w << "x" << h << ": first frame " << first
+                << " ms" << endl;
+        string serialCells;
+        double serialBest = 0;
+        for (int threads = 1; threads <= maxThreads; ++threads) {
+            scratch.setThreads(threads);
+            double best = fullFrame();
+            for (int run = 1; run < runs; ++run) {
+                best = min(best, fullFrame());
+            }
+            if (threads == 1) {
+                serialCells = boardCells();
+                serialBest = best;
+            }
+            bool identical = threads == 1 || boardCells() == serialCells;
+            cout << "  " << threads << (threads == 1 ? " thread: " : " threads: ") << best << " ms (best of " << runs
+                    << ", " << static_cast<long long>(scratch.shapes.size() / best * 1000) << " shapes/s, speedup "
+                    << serialBest / best << "x)" << (identical ? "" : " OUTPUT DIFFERS FROM 1 THREAD") << endl;
+        }
+        if (maxThreads > 1) {
+            cout << "Last tiled frame: " << scratch.tileBins.size() << " tiles, " << scratch.tileMerges.size()
+                    << " split, " << scratch.tileTasks.size() << " tasks" << endl;
+            scratch.pool->printStats();
+        }
+
+        // Incremental frames: one shape moves and only the two boxes it covered are redrawn.
+        double moveBest = 0;
+        for (int run = 0; run < runs; ++run) {
+            int id = scratch.ID * (run + 1) / (runs + 1);
+            AnyShape *shape = scratch.shapes.find(id);
+            if (!shape) {
+                continue;
+            }
+            auto start = chrono::steady_clock::now();
+            scratch.relocate(id, *shape, coordinate(w), coordinate(h));
+            scratch.renderScene();
+            double elapsed = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+            moveBest = moveBest == 0 ? elapsed : min(moveBest, elapsed);
+        }
+        cout << "One-shape move redrawn in " << moveBest << " ms (best of " << runs << ")" << endl;
     }
 
+    // Takes back the last add or load. When that step added every ID still in use, as
+    // after a load, the scene is emptied in one go instead of shape by shape.
     void undoShape() {
-        if (!shapeStack.empty()) {
-            int lastShape = shapeStack.top();
-            shapeStack.pop();
-            shapes.erase(lastShape);
-            ID--;
-        } else {
+        if (shapeStack.empty()) {
             cout << "There is nothing to undo!" << endl;
+            return;
+        }
+        IdRange last = shapeStack.top();
+        shapeStack.pop();
+        if (last.firstId == 1 && last.count == ID - 1) {
+            shapes.clear();
+            shapeKeys.clear();
+            spatialIndex.clear();
+            rasterCache.clear();
+            markAllDirty();
+        } else {
+            for (int lastShape = last.firstId + last.count - 1; lastShape >= last.firstId; --lastShape) {
+                if (AnyShape *undone = shapes.find(lastShape)) {
+                    forgetKey(*undone);
+                    markDirty(undone->getBounds());
+                    shapes.erase(lastShape);
+                }
+                spatialIndex.remove(lastShape);
+                rasterCache.invalidate(lastShape);
+            }
         }
+        ID -= last.count;
     }
 
     void clearShapes() {
         board.clear();
         shapes.clear();
+        shapeKeys.clear();
+        spatialIndex.clear();
+        rasterCache.clear();
+        markAllDirty();
         while (!shapeStack.empty()) {
             shapeStack.pop();
         }
         ID = 1;
     }
 
-    const map<int, shared_ptr<Shape> > &getShapes() const {
+    void resizeBoard(int width, int height) {
+        board.resize(width, height);
+        rasterCache.clear();
+        markAllDirty();
+    }
+
+    void setDifferential(bool enabled) {
+        board.setDifferential(enabled);
+    }
+
+    void setPicking(bool enabled) {
+        board.setOwnersEnabled(enabled);
+        markAllDirty();
+        cout << "Picking by ID buffer " << (enabled ? "enabled." : "disabled.") << endl;
+    }
+
+    void setThreads(int threads) {
+        if (threads <= 0) {
+            throw invalid_argument("Thread count must be positive.");
+        }
+        pool = make_unique<ThreadPool>(threads);
+        batches.resize(threads);
+    }
+
+    void printStats() const {
+        cout << "Shapes: " << shapes.size() << ", board " << board.width << "x" << board.height << ", "
+                << pool->size() << " render threads" << endl;
+        if (!tileTasks.empty()) {
+            cout << "Last tiled frame: " << tileBins.size() << " tiles, " << tileMerges.size() << " split, "
+                    << tileTasks.size() << " tasks" << endl;
+        }
+        pool->printStats();
+        rasterCache.printStats();
+    }
+
+    const ShapeStore &getShapes() const {
         return shapes;
     }
 
+    const Board &getBoard() const {
+        return board;
+    }
+
+    int getNextId() const {
+        return ID;
+    }
+
+    // The undo steps, oldest first.
+    vector<IdRange> getUndoSteps() const {
+        vector<IdRange> steps;
+        for (stack<IdRange> rest = shapeStack; !rest.empty(); rest.pop()) {
+            steps.push_back(rest.top());
+        }
+        reverse(steps.begin(), steps.end());
+        return steps;
+    }
+
+    // The selected shape, or an empty handle once it is gone.
+    ShapeHandle getSelection() {
+        return shapes.find(select) ? select : ShapeHandle();
+    }
+
+    // Puts back a shape under the ID it had, without checks or undo. Shapes must come
+    // in ascending ID order, into a cleared scene, followed by restoreHistory.
+    void restoreShape(int id, AnyShape shape) {
+        rememberKey(shape);
+        spatialIndex.insert(id, indexBounds(shape));
+        shapes.insert(id, std::move(shape));
+    }
+
+    void restoreHistory(int nextId, const vector<IdRange> &undoSteps) {
+        ID = nextId;
+        for (const IdRange &step: undoSteps) {
+            shapeStack.push(step);
+        }
+        markAllDirty();
+    }
+
+    // The render threads, lent to the loader between frames.
+    ThreadPool &getThreadPool() {
+        return *pool;
+    }
+
     void selectByID(int id) {
-        for (const auto &shape: shapes) {
-            if (shape.first == id) {
-                select = shape.second;
-                shape.second->print();
-                return;
-            }
+        if (AnyShape *shape = shapes.find(id)) {
+            select = shapes.handle(id);
+            shape->print();
+            return;
         }
         cout << "Shape with ID " << id << " not found." << endl;
     }
 
+    // With picking on, the owner buffer answers directly with the topmost visible shape;
+    // it is re-rendered first only if the scene changed since the last draw.
     void selectByCoordinates(int cx, int cy) {
-        for (const auto &shape: shapes) {
-            if (shape.second->coordinateContains(cx, cy)) {
-                select = shape.second;
-                cout << "Shape selected: ID " << shape.first << " ";
-                shape.second->print();
+        if (board.ownersEnabled()) {
+            if (!ownersValid) {
+                renderScene();
+            }
+            int id = board.ownerAt(cx, cy);
+            if (id != 0) {
+                select = shapes.handle(id);
+                cout << "Shape selected: ID " << id << " ";
+                shapes.find(id)->print();
+            } else {
+                cout << "Shape was not found at coordinates (" << cx << ", " << cy << ")" << endl;
+            }
+            return;
+        }
+        for (int id: spatialIndex.queryPoint(cx, cy)) {
+            const AnyShape *shape = shapes.find(id);
+            if (shape->coordinateContains(cx, cy)) {
+                select = shapes.handle(id);
+                cout << "Shape selected: ID " << id << " ";
+                shape->print();
                 return;
             }
         }
@@ -692,419 +2743,1401 @@ public:
     }
 
     void remove() {
-        if (auto selectedShape = select.lock()) {
-            for (auto &shape: shapes) {
-                if (shape.second == selectedShape) {
-                    int id = shape.first;
-                    cout << id << " " << shape.second->getType() << " removed" << endl;
-                    shapes.erase(id);
-                    select.reset();
-                    return;
-                }
-            }
+        if (AnyShape *selectedShape = shapes.find(select)) {
+            int id = select.id;
+            cout << id << " " << selectedShape->getType() << " removed" << endl;
+            forgetKey(*selectedShape);
+            markDirty(selectedShape->getBounds());
+            shapes.erase(id);
+            spatialIndex.remove(id);
+            rasterCache.invalidate(id);
+            select = ShapeHandle();
         } else {
             cout << "No shape selected to remove." << endl;
         }
     }
 
-    void paint(string color) {
-        if (auto selectedShape = select.lock()) {
-            for (auto &shape: shapes) {
-                if (shape.second == selectedShape) {
-                    shape.second->setColor(color);
-                    cout << "ID: " << shape.first << " Shape: " << shape.second->getType() << " Color: " <<
-                            shape.second->getColor() << endl;
-                    return;
-                }
-            }
+    void paint(string_view color) {
+        if (AnyShape *selectedShape = shapes.find(select)) {
+            selectedShape->setColor(color);
+            rasterCache.invalidate(select.id);
+            markDirty(selectedShape->getBounds());
+            cout << "ID: " << select.id << " Shape: " << selectedShape->getType() << " Color: " <<
+                    selectedShape->getColor() << endl;
         } else {
             cout << "No shape selected to paint." << endl;
         }
     }
 
     void move(int x, int y) {
-        if (auto selectedShape = select.lock()) {
-            for (auto &shape: shapes) {
-                if (shape.second == selectedShape) {
-                    int deltaX, deltaY;
-
-                    if (shape.second->getType() == "Line") {
-                        deltaX = x - shape.second->getX();
-                        deltaY = y - shape.second->getY();
-                        shape.second->setX(x);
-                        shape.second->setY(y);
-
-                        Line *line = static_cast<Line *>(shape.second.get());
-                        line->setX2(line->getX2() + deltaX);
-                        line->setY2(line->getY2() + deltaY);
-                    } else if (shape.second->getType() == "Triangle") {
-                        deltaX = x - shape.second->getX();
-                        deltaY = y - shape.second->getY();
-                        shape.second->setX(x);
-                        shape.second->setY(y);
-
-                        Triangle *triangle = static_cast<Triangle *>(shape.second.get());
-                        triangle->setX2(triangle->getX2() + deltaX);
-                        triangle->setY2(triangle->getY2() + deltaY);
-                        triangle->setX3(triangle->getX3() + deltaX);
-                        triangle->setY3(triangle->getY3() + deltaY);
+        if (AnyShape *selectedShape = shapes.find(select)) {
+            relocate(select.id, *selectedShape, x, y);
+            cout << "ID: " << select.id << " Shape: " << selectedShape->getType() << " moved." << endl;
+        } else {
+            cout << "No shape selected to move." << endl;
+        }
+    }
+
+    void edit(Tokenizer &tokens) {
+        AnyShape *selectedShape = shapes.find(select);
+        if (!selectedShape) {
+            cout << "No shape selected for editing." << endl;
+            return;
+        }
+        if (Line *line = selectedShape->as<Line>()) {
+            char newSymbol;
+            if (tokens.next(newSymbol)) {
+                beginEdit(select.id, *selectedShape);
+                line->setCustomSymbol(newSymbol);
+                cout << "Line symbol changed to '" << newSymbol << "'." << endl;
+            } else {
+                cout << "Please provide a valid symbol for the line!" << endl;
+            }
+        } else if (Triangle *triangle = selectedShape->as<Triangle>()) {
+            char newSymbol;
+            if (tokens.next(newSymbol)) {
+                beginEdit(select.id, *selectedShape);
+                triangle->setCustomSymbol(newSymbol);
+                cout << "Triangle symbol changed to '" << newSymbol << "'." << endl;
+            } else {
+                cout << "Please provide a valid symbol for the triangle!" << endl;
+            }
+        } else {
+            int par1, par2;
+            if (!(tokens.next(par1))) {
+                cout << "Error: provide valid params for the shape." << endl;
+            } else if (Circle *circle = selectedShape->as<Circle>()) {
+                if (!(tokens.next(par2))) {
+                    if (par1 > 0 && circle->validBorder(board)) {
+                        beginEdit(select.id, *selectedShape);
+                        forgetKey(*selectedShape);
+                        circle->setRadius(par1);
+                        rememberKey(*selectedShape);
+                        reindex(select.id, *selectedShape);
+                        cout << "Radius of circle changed." << endl;
+                    } else {
+                        cout << "Error: invalid radius or shape will go out of the board." << endl;
+                    }
+                } else {
+                    cout << "Error: invalid argument count for circle." << endl;
+                }
+            } else if (Rectangle *rectangle = selectedShape->as<Rectangle>()) {
+                if (tokens.next(par2)) {
+                    if (par1 > 0 && par2 > 0 && rectangle->validBorder(board)) {
+                        beginEdit(select.id, *selectedShape);
+                        forgetKey(*selectedShape);
+                        rectangle->setHeight(par1);
+                        rectangle->setWidth(par2);
+                        rememberKey(*selectedShape);
+                        reindex(select.id, *selectedShape);
+                        cout << "Size of rectangle changed." << endl;
                     } else {
-                        shape.second->setX(x);
-                        shape.second->setY(y);
+                        cout << "Error: invalid size or shape will go out of the board." << endl;
                     }
+                } else {
+                    cout << "Error: invalid argument count for rectangle." << endl;
+                }
+            }
+        }
+    }
+};
 
-                    cout << "ID: " << shape.first << " Shape: " << shape.second->getType() << " moved." << endl;
-                    return;
+
+class ShapeParser {
+private:
+    ShapeCommands &shapeCommands;
+
+    static const char *shapeName(Keyword type) {
+        switch (type) {
+            case Keyword::RECTANGLE:
+                return "Rectangle";
+            case Keyword::CIRCLE:
+                return "Circle";
+            case Keyword::TRIANGLE:
+                return "Triangle";
+            default:
+                return "Line";
+        }
+    }
+
+    // How many numbers each shape takes, in constructor order.
+    static int paramCount(Keyword type) {
+        switch (type) {
+            case Keyword::CIRCLE:
+                return 3;
+            case Keyword::TRIANGLE:
+                return 6;
+            default:
+                return 4;
+        }
+    }
+
+    static Keyword shapeTypeOf(string_view word) {
+        Keyword type = keywordOf(word, true);
+        if (type != Keyword::RECTANGLE && type != Keyword::CIRCLE && type != Keyword::TRIANGLE &&
+            type != Keyword::LINE) {
+            throw invalid_argument("Unknown shape.");
+        }
+        return type;
+    }
+
+    static string argumentError(const char *problem, Keyword type) {
+        return string(problem) + " arguments for " + shapeName(type) + ". Expected " + to_string(paramCount(type)) +
+               ".";
+    }
+
+    static array<int, 6> readParams(Keyword type, Tokenizer &tokens) {
+        array<int, 6> params{};
+        for (int i = 0; i < paramCount(type); ++i) {
+            if (!tokens.next(params[i])) {
+                throw invalid_argument(argumentError("Invalid number of", type));
+            }
+        }
+        return params;
+    }
+
+    // Builds the shape once its fill mode is known and nothing is left in rest; a line
+    // takes no fill mode but accepts "none" in its place.
+    static AnyShape buildShape(Keyword type, const array<int, 6> &p, string_view color, string_view fillMode,
+                               Tokenizer &rest) {
+        if (type == Keyword::LINE) {
+            if (!fillMode.empty() && fillMode != "none") {
+                throw invalid_argument(argumentError("Too many", type));
+            }
+            return Line(p[0], p[1], p[2], p[3], false, color);
+        }
+        FillOption fillOption;
+        switch (keywordOf(fillMode, true)) {
+            case Keyword::FILL:
+                fillOption = FILL;
+                break;
+            case Keyword::FRAME:
+                fillOption = FRAME;
+                break;
+            default:
+                throw invalid_argument("Incorrect form! Use 'fill' or 'frame'");
+        }
+        if (!rest.empty()) {
+            throw invalid_argument(argumentError("Too many", type));
+        }
+        if (type == Keyword::RECTANGLE) {
+            return Rectangle(p[0], p[1], p[2], p[3], fillOption, color);
+        }
+        if (type == Keyword::CIRCLE) {
+            return Circle(p[0], p[1], p[2], fillOption, color);
+        }
+        return Triangle(p[0], p[1], p[2], p[3], p[4], p[5], fillOption, color);
+    }
+
+public:
+    ShapeParser(ShapeCommands &sc) : shapeCommands(sc) {
+    }
+
+    // "<type> <numbers> <color> <fill mode>", as typed after add.
+    void parseAddShapes(Tokenizer &tokens) {
+        Keyword type = shapeTypeOf(tokens.next());
+        array<int, 6> params = readParams(type, tokens);
+        string_view color = tokens.next();
+        string_view fillMode = tokens.next();
+        shapeCommands.addShape(buildShape(type, params, color, fillMode, tokens));
+    }
+
+    // The parts of a saved record, already split apart by the file loader. Touches no
+    // state, so loaders may call it from several threads.
+    static AnyShape readSavedShape(string_view shapeType, string_view shapeParams, string_view color,
+                                   string_view fillMode) {
+        Keyword type = shapeTypeOf(shapeType);
+        Tokenizer params(shapeParams);
+        array<int, 6> values = readParams(type, params);
+        if (!params.empty()) {
+            throw invalid_argument(argumentError("Too many", type));
+        }
+        return buildShape(type, values, color, fillMode, params);
+    }
+};
+
+// A whole file mapped read-only for one front-to-back pass. Files that cannot be
+// mapped, such as pipes, are read into memory instead.
+class MappedFile {
+private:
+    int descriptor = -1;
+    void *mapping = MAP_FAILED;
+    size_t length = 0;
+    string fallback;
+
+public:
+    explicit MappedFile(const string &filePath) {
+        descriptor = open(filePath.c_str(), O_RDONLY);
+        if (descriptor < 0) {
+            return;
+        }
+        struct stat info{};
+        if (fstat(descriptor, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            length = static_cast<size_t>(info.st_size);
+            mapping = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, descriptor, 0);
+            if (mapping != MAP_FAILED) {
+                madvise(mapping, length, MADV_SEQUENTIAL);
+                return;
+            }
+        }
+        char buffer[1 << 16];
+        ssize_t count;
+        while ((count = read(descriptor, buffer, sizeof(buffer))) > 0) {
+            fallback.append(buffer, static_cast<size_t>(count));
+        }
+        length = fallback.size();
+    }
+
+    ~MappedFile() {
+        if (mapping != MAP_FAILED) {
+            munmap(mapping, length);
+        }
+        if (descriptor >= 0) {
+            close(descriptor);
+        }
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool isOpen() const {
+        return descriptor >= 0;
+    }
+
+    const char *data() const {
+        return mapping != MAP_FAILED ? static_cast<const char *>(mapping) : fallback.data();
+    }
+
+    size_t size() const {
+        return length;
+    }
+};
+
+// Binary scenes (.bbin). Every integer is little-endian whatever the host.
+//   header:  "BBIN", u16 version, u16 palette size, u64 record count
+//   palette: per colour a u8 name length and the name; records refer to colours by index
+//   records: u8 shape kind, u8 colour index, u8 fill mode (FillOption, or 2 for a line),
+//            u8 reserved, i32 ID, then the shape's numbers as i32 in constructor order:
+//            4 for rectangles and lines, 3 for circles, 6 for triangles
+// Journal snapshots are version 2: the header goes on with u64 journal seq, i32 board
+// width and height, i32 next ID and u32 undo step count; the reserved record byte holds
+// the symbol edit gave the shape (0 for none); the records are followed by the undo
+// steps, oldest first, as i32 first ID and i32 count.
+class FileParser {
+private:
+    ShapeCommands &shapeCommands;
+    // Batch runs have nobody to answer the question before a load.
+    bool confirmLoad = true;
+
+    static constexpr char BINARY_MAGIC[4] = {'B', 'B', 'I', 'N'};
+    static const unsigned BINARY_VERSION = 1;
+    static const unsigned SNAPSHOT_VERSION = 2;
+    static const size_t BINARY_HEADER_SIZE = 16;
+    static const size_t SNAPSHOT_HEADER_SIZE = 40;
+    static const size_t RECORD_HEADER_SIZE = 8;
+    static const unsigned char LINE_FILL = 2;
+    static constexpr int PARAM_COUNT[4] = {4, 3, 4, 6};
+    // Records are written out in chunks of about this many bytes.
+    static const size_t WRITE_CHUNK = 1 << 20;
+
+    static bool isBinaryScene(const string &filePath) {
+        const string extension = ".bbin";
+        return filePath.size() >= extension.size() &&
+               filePath.compare(filePath.size() - extension.size(), extension.size(), extension) == 0;
+    }
+
+    static void putLittleEndian(char *out, unsigned long long value, int bytes) {
+        for (int i = 0; i < bytes; ++i) {
+            out[i] = static_cast<char>(value >> (8 * i));
+        }
+    }
+
+    static unsigned long long getLittleEndian(const char *in, int bytes) {
+        unsigned long long value = 0;
+        for (int i = 0; i < bytes; ++i) {
+            value |= static_cast<unsigned long long>(static_cast<unsigned char>(in[i])) << (8 * i);
+        }
+        return value;
+    }
+
+    static AnyShape makeShape(ShapeKind kind, const int *p, FillOption fillOption, ColorId color) {
+        string_view colorName = PALETTE[color].name;
+        switch (kind) {
+            case RECTANGLE:
+                return Rectangle(p[0], p[1], p[2], p[3], fillOption, colorName);
+            case CIRCLE:
+                return Circle(p[0], p[1], p[2], fillOption, colorName);
+            case LINE:
+                return Line(p[0], p[1], p[2], p[3], false, colorName);
+            default:
+                return Triangle(p[0], p[1], p[2], p[3], p[4], p[5], fillOption, colorName);
+        }
+    }
+
+    static void putPalette(vector<char> &out) {
+        for (const PaletteEntry &entry: PALETTE) {
+            size_t length = strlen(entry.name);
+            out.push_back(static_cast<char>(length));
+            out.insert(out.end(), entry.name, entry.name + length);
+        }
+    }
+
+    // Scenes leave the byte after the fill mode 0; snapshots keep the edited symbol there.
+    static void putRecord(vector<char> &out, int ID, const AnyShape &shape, char symbol) {
+        ShapeKey key = shape.getKey();
+        unsigned char fill = shape.apply([](const auto &kind) -> unsigned char {
+            if constexpr (is_same_v<decay_t<decltype(kind)>, Line>) {
+                return LINE_FILL;
+            } else {
+                return kind.getFillOption();
+            }
+        });
+        char record[RECORD_HEADER_SIZE + 6 * 4];
+        record[0] = static_cast<char>(key.kind);
+        record[1] = static_cast<char>(shape.getColorId());
+        record[2] = static_cast<char>(fill);
+        record[3] = symbol;
+        putLittleEndian(record + 4, static_cast<unsigned>(ID), 4);
+        int count = PARAM_COUNT[key.kind];
+        for (int i = 0; i < count; ++i) {
+            putLittleEndian(record + RECORD_HEADER_SIZE + 4 * i, static_cast<unsigned>(key.params[i]), 4);
+        }
+        out.insert(out.end(), record, record + RECORD_HEADER_SIZE + 4 * count);
+    }
+
+    // Maps the palette at in to colour IDs and moves past it. False if it is truncated.
+    static bool getPalette(const char *&in, const char *end, size_t paletteSize, array<ColorId, 256> &colors) {
+        for (size_t entry = 0; entry < paletteSize; ++entry) {
+            size_t length = in == end ? 0 : static_cast<unsigned char>(*in);
+            if (static_cast<size_t>(end - in) < 1 + length) {
+                return false;
+            }
+            colors[entry] = colorIdOf(string_view(in + 1, length));
+            in += 1 + length;
+        }
+        return true;
+    }
+
+    struct Record {
+        ShapeKind kind;
+        ColorId color;
+        FillOption fill;
+        char symbol;
+        int id;
+        int params[6];
+    };
+
+    // Decodes the record at in and moves past it. Returns what is wrong with it, if
+    // anything, to follow "record n".
+    static string getRecord(const char *&in, const char *end, size_t paletteSize,
+                            const array<ColorId, 256> &colors, Record &record) {
+        if (static_cast<size_t>(end - in) < RECORD_HEADER_SIZE) {
+            return " is truncated.";
+        }
+        unsigned kind = static_cast<unsigned char>(in[0]);
+        unsigned color = static_cast<unsigned char>(in[1]);
+        unsigned fill = static_cast<unsigned char>(in[2]);
+        if (kind > TRIANGLE) {
+            return " has unknown shape kind " + to_string(kind) + ".";
+        }
+        size_t recordSize = RECORD_HEADER_SIZE + 4 * PARAM_COUNT[kind];
+        if (static_cast<size_t>(end - in) < recordSize) {
+            return " is truncated.";
+        }
+        if (color >= paletteSize) {
+            return " has colour index " + to_string(color) + " outside the palette.";
+        }
+        if (kind == LINE ? fill != LINE_FILL : fill > FRAME) {
+            return " has fill mode " + to_string(fill) + ".";
+        }
+        record.kind = static_cast<ShapeKind>(kind);
+        record.color = colors[color];
+        record.fill = static_cast<FillOption>(fill);
+        record.symbol = in[3];
+        record.id = static_cast<int>(static_cast<unsigned>(getLittleEndian(in + 4, 4)));
+        for (int i = 0; i < PARAM_COUNT[kind]; ++i) {
+            record.params[i] = static_cast<int>(static_cast<unsigned>(getLittleEndian(in + RECORD_HEADER_SIZE + 4 * i,
+                                                                                       4)));
+        }
+        in += recordSize;
+        return "";
+    }
+
+    bool saveText(const string &filePath) {
+        ofstream file(filePath);
+        if (!file.is_open()) {
+            cout << "Failed to open file for saving." << endl;
+            return false;
+        }
+        shapeCommands.getShapes().forEach([&file](int ID, const AnyShape &shape) {
+            shape.apply([&file, ID](const auto &kind) {
+                string fillMode = "none";
+                if constexpr (!is_same_v<decay_t<decltype(kind)>, Line>) {
+                    fillMode = fillOptionType(kind.getFillOption());
                 }
+                file << "ID: " << ID << " Type: " << kind.getType() << " " << kind.getParams()
+                        << " Color: " << kind.getColor() << " FillMode: " << fillMode << '\n';
+            });
+        });
+        file.close();
+        return true;
+    }
+
+    bool saveBinary(const string &filePath) {
+        ofstream file(filePath, ios::binary);
+        if (!file.is_open()) {
+            cout << "Failed to open file for saving." << endl;
+            return false;
+        }
+        const ShapeStore &shapes = shapeCommands.getShapes();
+        vector<char> out(BINARY_HEADER_SIZE);
+        out.reserve(WRITE_CHUNK + RECORD_HEADER_SIZE + 6 * 4);
+        memcpy(out.data(), BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        putLittleEndian(&out[4], BINARY_VERSION, 2);
+        putLittleEndian(&out[6], PALETTE_SIZE, 2);
+        putLittleEndian(&out[8], shapes.size(), 8);
+        putPalette(out);
+        shapes.forEach([&file, &out](int ID, const AnyShape &shape) {
+            putRecord(out, ID, shape, 0);
+            if (out.size() >= WRITE_CHUNK) {
+                file.write(out.data(), static_cast<streamsize>(out.size()));
+                out.clear();
+            }
+        });
+        file.write(out.data(), static_cast<streamsize>(out.size()));
+        file.close();
+        if (!file) {
+            cout << "Failed to write " << filePath << endl;
+            return false;
+        }
+        return true;
+    }
+
+    // Whole lines of a text save, parsed on a worker: the shapes in line order up to
+    // the first bad line, and then the message the serial loader would have printed.
+    struct TextChunk {
+        string_view text;
+        vector<AnyShape> shapes;
+        string error;
+    };
+
+    // Text saves are cut at the first line end after every TEXT_CHUNK bytes.
+    static constexpr size_t TEXT_CHUNK = 1 << 20;
+
+    // Like getline, the last line needs no newline.
+    static void parseTextChunk(TextChunk &chunk) {
+        const char *end = chunk.text.data() + chunk.text.size();
+        for (const char *start = chunk.text.data(); start < end;) {
+            const char *newline = static_cast<const char *>(memchr(start, '\n', end - start));
+            const char *stop = newline ? newline : end;
+            string_view line(start, stop - start);
+            start = stop + 1;
+            Tokenizer tokens(line);
+            int id;
+            bool hasHeader = !tokens.next().empty() && tokens.next(id) && !tokens.next().empty();
+            string_view shapeType = tokens.next();
+            if (!hasHeader || shapeType.empty()) {
+                chunk.error = "Invalid file format: " + string(line);
+                return;
+            }
+            string_view shapeParams;
+            if (shapeType == "Circle" || shapeType == "Rectangle" || shapeType == "Triangle" || shapeType == "Line") {
+                shapeParams = tokens.until('C');
+            }
+
+            string_view colorText = tokens.next();
+            string_view color = tokens.next();
+            string_view fillText = tokens.next();
+            string_view fillMode = tokens.next();
+            if (colorText.empty() || color.empty() || fillText.empty() || fillMode.empty()) {
+                chunk.error = "Invalid file format: " + string(line);
+                return;
+            }
+
+            try {
+                chunk.shapes.push_back(ShapeParser::readSavedShape(shapeType, shapeParams, color, fillMode));
+            } catch (const exception &e) {
+                chunk.error = string("Error: ") + e.what();
+                return;
             }
-        } else {
-            cout << "No shape selected to move." << endl;
         }
     }
 
-    void edit(istringstream &iss) {
-        if (auto selectedShape = select.lock()) {
-            if (selectedShape->getType() == "Line") {
-                char newSymbol;
-                if (iss >> newSymbol) {
-                    Line *line = dynamic_cast<Line *>(selectedShape.get());
-                    line->setCustomSymbol(newSymbol);
-                    cout << "Line symbol changed to '" << newSymbol << "'." << endl;
-                } else {
-                    cout << "Please provide a valid symbol for the line!" << endl;
-                }
-            } else if (selectedShape->getType() == "Triangle") {
-                char newSymbol;
-                if (iss >> newSymbol) {
-                    auto *triangle = dynamic_cast<Triangle *>(selectedShape.get());
-                    triangle->setCustomSymbol(newSymbol);
-                    cout << "Triangle symbol changed to '" << newSymbol << "'." << endl;
-                } else {
-                    cout << "Please provide a valid symbol for the triangle!" << endl;
+    // Parses a few chunks per render thread at a time on the pool, then bulk adds their
+    // shapes on this thread in file order, so IDs, duplicate checks and messages come out
+    // as from a serial pass and the whole load is one undo step. The first chunk with a
+    // bad line ends the load after the shapes before that line.
+    bool loadText(const char *data, size_t size) {
+        size_t lines = 0;
+        for (const char *line = data; line < data + size; ++lines) {
+            const char *newline = static_cast<const char *>(memchr(line, '\n', data + size - line));
+            line = newline ? newline + 1 : data + size;
+        }
+        shapeCommands.reserveShapes(lines);
+
+        ThreadPool &pool = shapeCommands.getThreadPool();
+        bool joined = false;
+        vector<TextChunk> chunks(pool.size() * 4);
+        const char *next = data;
+        const char *end = data + size;
+        while (next < end) {
+            size_t count = 0;
+            for (; count < chunks.size() && next < end; ++count) {
+                const char *stop = next + min(TEXT_CHUNK, static_cast<size_t>(end - next));
+                if (stop < end) {
+                    const char *newline = static_cast<const char *>(memchr(stop, '\n', end - stop));
+                    stop = newline ? newline + 1 : end;
                 }
-            } else if (selectedShape->getType() == "Circle" || selectedShape->getType() == "Rectangle") {
-                int par1, par2;
-                if (iss >> par1) {
-                    if (selectedShape->getType() == "Circle") {
-                        auto *circle = dynamic_cast<Circle *>(selectedShape.get());
-                        if (!(iss >> par2)) {
-                            if (par1 > 0 && circle->validBorder()) {
-                                circle->setRadius(par1);
-                                cout << "Radius of circle changed." << endl;
-                            } else {
-                                cout << "Error: invalid radius or shape will go out of the board." << endl;
-                            }
-                        } else {
-                            cout << "Error: invalid argument count for circle." << endl;
-                        }
-                    } else if (selectedShape->getType() == "Rectangle") {
-                        auto *rectangle = dynamic_cast<Rectangle *>(selectedShape.get());
-                        if (iss >> par2) {
-                            if (par1 > 0 && par2 > 0 && rectangle->validBorder()) {
-                                rectangle->setHeight(par1);
-                                rectangle->setWidth(par2);
-                                cout << "Size of rectangle changed." << endl;
-                            } else {
-                                cout << "Error: invalid size or shape will go out of the board." << endl;
-                            }
-                        } else {
-                            cout << "Error: invalid argument count for rectangle." << endl;
-                        }
-                    }
-                } else {
-                    cout << "Error: provide valid params for the shape." << endl;
+                TextChunk &chunk = chunks[count];
+                chunk.text = string_view(next, stop - next);
+                chunk.shapes.clear();
+                chunk.error.clear();
+                next = stop;
+            }
+            pool.run(count, [&chunks](size_t index, size_t) { parseTextChunk(chunks[index]); });
+            for (size_t index = 0; index < count; ++index) {
+                shapeCommands.addShapes(chunks[index].shapes, joined);
+                joined = true;
+                if (!chunks[index].error.empty()) {
+                    cout << chunks[index].error << endl;
+                    return false;
                 }
             }
-        } else {
-            cout << "No shape selected for editing." << endl;
         }
+        return true;
     }
-};
-
-
-class ShapeParser {
-private:
-    ShapeCommands &shapeCommands;
-    FillOption fillOption;
 
-    string toLowerCase(const string &str) {
-        string result = str;
-        for (char &c: result) {
-            c = tolower(c);
+    // Records decoded before each bulk add of a binary load.
+    static const size_t BINARY_BATCH = 1 << 16;
+
+    // Adds the shapes of a whole binary scene held in data, in record order and as one
+    // undo step, with the same checks as a typed add. Returns false, having said why, on
+    // malformed input.
+    bool loadBinary(const char *data, size_t size) {
+        vector<AnyShape> batch;
+        bool joined = false;
+        auto flush = [this, &batch, &joined] {
+            shapeCommands.addShapes(batch, joined);
+            batch.clear();
+            joined = true;
+        };
+        auto invalid = [&flush](const string &reason) {
+            flush();
+            cout << "Invalid binary scene: " << reason << endl;
+            return false;
+        };
+        if (size < BINARY_HEADER_SIZE || memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0) {
+            return invalid("bad header.");
+        }
+        unsigned long long version = getLittleEndian(data + 4, 2);
+        if (version != BINARY_VERSION) {
+            return invalid("unsupported version " + to_string(version) + ".");
+        }
+        size_t paletteSize = getLittleEndian(data + 6, 2);
+        unsigned long long records = getLittleEndian(data + 8, 8);
+        if (paletteSize > 256) {
+            return invalid("palette too large.");
+        }
+        const char *in = data + BINARY_HEADER_SIZE;
+        const char *end = data + size;
+        // A corrupt count must not reserve more than the file can hold.
+        shapeCommands.reserveShapes(min<unsigned long long>(records, size / RECORD_HEADER_SIZE));
+        batch.reserve(min<unsigned long long>(records, BINARY_BATCH));
+        array<ColorId, 256> colors{};
+        if (!getPalette(in, end, paletteSize, colors)) {
+            return invalid("truncated palette.");
+        }
+        Record decoded;
+        for (unsigned long long record = 0; record < records; ++record) {
+            string problem = getRecord(in, end, paletteSize, colors, decoded);
+            if (!problem.empty()) {
+                return invalid("record " + to_string(record + 1) + problem);
+            }
+            batch.push_back(makeShape(decoded.kind, decoded.params, decoded.fill, decoded.color));
+            if (batch.size() == BINARY_BATCH) {
+                flush();
+            }
         }
-        return result;
+        flush();
+        if (in != end) {
+            return invalid("unexpected data after the last record.");
+        }
+        return true;
     }
 
 public:
-    ShapeParser(ShapeCommands &sc) : shapeCommands(sc) {
+    FileParser(ShapeCommands &sc) : shapeCommands(sc) {
     }
 
-    void parseAddShapes(istringstream &iss) {
-        string shapeType;
-        iss >> shapeType;
-        shapeType = toLowerCase(shapeType);
-        string extraArg;
+    void setConfirmLoad(bool enabled) {
+        confirmLoad = enabled;
+    }
 
-        if (shapeType == "rectangle") {
-            int x, y, height, width;
-            string shapeColor, fillMode;
-            if (!(iss >> x >> y >> height >> width)) {
-                throw invalid_argument("Invalid number of arguments for Rectangle. Expected 4.");
-            }
-            iss >> shapeColor;
-            iss >> fillMode;
-            fillMode = toLowerCase(fillMode);
-            if (fillMode == "fill") {
-                fillOption = FILL;
-            } else if (fillMode == "frame") {
-                fillOption = FRAME;
-            } else {
-                throw invalid_argument("Incorrect form! Use 'fill' or 'frame'");
-            }
-            if (iss >> extraArg) {
-                throw invalid_argument("Too many arguments for Rectangle. Expected 4.");
+    // The whole scene, with IDs and undo steps, as a snapshot of the journal up to seq.
+    vector<char> encodeSnapshot(unsigned long long seq) const {
+        const ShapeStore &shapes = shapeCommands.getShapes();
+        const Board &board = shapeCommands.getBoard();
+        vector<ShapeCommands::IdRange> undoSteps = shapeCommands.getUndoSteps();
+        vector<char> out(SNAPSHOT_HEADER_SIZE);
+        out.reserve(SNAPSHOT_HEADER_SIZE + 64 + shapes.size() * (RECORD_HEADER_SIZE + 4 * 4) + undoSteps.size() * 8);
+        memcpy(out.data(), BINARY_MAGIC, sizeof(BINARY_MAGIC));
+        putLittleEndian(&out[4], SNAPSHOT_VERSION, 2);
+        putLittleEndian(&out[6], PALETTE_SIZE, 2);
+        putLittleEndian(&out[8], shapes.size(), 8);
+        putLittleEndian(&out[16], seq, 8);
+        putLittleEndian(&out[24], static_cast<unsigned>(board.width), 4);
+        putLittleEndian(&out[28], static_cast<unsigned>(board.height), 4);
+        putLittleEndian(&out[32], static_cast<unsigned>(shapeCommands.getNextId()), 4);
+        putLittleEndian(&out[36], undoSteps.size(), 4);
+        putPalette(out);
+        shapes.forEach([&out](int ID, const AnyShape &shape) {
+            putRecord(out, ID, shape, shape.getCustomSymbol());
+        });
+        for (const ShapeCommands::IdRange &step: undoSteps) {
+            char entry[8];
+            putLittleEndian(entry, static_cast<unsigned>(step.firstId), 4);
+            putLittleEndian(entry + 4, static_cast<unsigned>(step.count), 4);
+            out.insert(out.end(), entry, entry + 8);
+        }
+        return out;
+    }
+
+    // Replaces the scene with a snapshot and sets seq to the journal record it ends
+    // at. Returns false, with the scene cleared, if the snapshot is malformed.
+    bool loadSnapshot(const char *data, size_t size, unsigned long long &seq) {
+        shapeCommands.clearShapes();
+        auto invalid = [this](const string &reason) {
+            shapeCommands.clearShapes();
+            cout << "Invalid snapshot: " << reason << endl;
+            return false;
+        };
+        if (size < SNAPSHOT_HEADER_SIZE || memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) != 0 ||
+            getLittleEndian(data + 4, 2) != SNAPSHOT_VERSION) {
+            return invalid("bad header.");
+        }
+        size_t paletteSize = getLittleEndian(data + 6, 2);
+        unsigned long long records = getLittleEndian(data + 8, 8);
+        int width = static_cast<int>(getLittleEndian(data + 24, 4));
+        int height = static_cast<int>(getLittleEndian(data + 28, 4));
+        int nextId = static_cast<int>(getLittleEndian(data + 32, 4));
+        size_t steps = getLittleEndian(data + 36, 4);
+        if (paletteSize > 256 || width <= 0 || height <= 0 || nextId <= 0) {
+            return invalid("bad header.");
+        }
+        seq = getLittleEndian(data + 16, 8);
+        const char *in = data + SNAPSHOT_HEADER_SIZE;
+        const char *end = data + size;
+        array<ColorId, 256> colors{};
+        if (!getPalette(in, end, paletteSize, colors)) {
+            return invalid("truncated palette.");
+        }
+        const Board &board = shapeCommands.getBoard();
+        if (width != board.width || height != board.height) {
+            shapeCommands.resizeBoard(width, height);
+        }
+        shapeCommands.reserveShapes(min<unsigned long long>(records, size / RECORD_HEADER_SIZE));
+        Record decoded;
+        int lastId = 0;
+        for (unsigned long long record = 0; record < records; ++record) {
+            string problem = getRecord(in, end, paletteSize, colors, decoded);
+            if (problem.empty() && (decoded.id <= lastId || decoded.id >= nextId)) {
+                problem = " has ID " + to_string(decoded.id) + " out of order.";
             }
-            shapeCommands.addShape(make_shared<Rectangle>(x, y, height, width, fillOption, shapeColor));
-        } else if (shapeType == "circle") {
-            int x, y, radius;
-            string shapeColor, fillMode;
-            if (!(iss >> x >> y >> radius)) {
-                throw invalid_argument("Invalid number of arguments for Circle. Expected 3.");
+            if (!problem.empty()) {
+                return invalid("record " + to_string(record + 1) + problem);
             }
-            iss >> shapeColor;
-            iss >> fillMode;
-            fillMode = toLowerCase(fillMode);
-            if (fillMode == "fill") {
-                fillOption = FILL;
-            } else if (fillMode == "frame") {
-                fillOption = FRAME;
-            } else {
-                throw invalid_argument("Incorrect form! Use 'fill' or 'frame'");
+            AnyShape shape = makeShape(decoded.kind, decoded.params, decoded.fill, decoded.color);
+            if (decoded.symbol != 0) {
+                shape.setCustomSymbol(decoded.symbol);
             }
-            if (iss >> extraArg) {
-                throw invalid_argument("Too many arguments for Circle. Expected 3.");
+            shapeCommands.restoreShape(decoded.id, std::move(shape));
+            lastId = decoded.id;
+        }
+        if (static_cast<size_t>(end - in) != steps * 8) {
+            return invalid("undo steps do not fill the rest of the file.");
+        }
+        vector<ShapeCommands::IdRange> undoSteps(steps);
+        int nextStep = 1;
+        for (ShapeCommands::IdRange &step: undoSteps) {
+            step.firstId = static_cast<int>(getLittleEndian(in, 4));
+            step.count = static_cast<int>(getLittleEndian(in + 4, 4));
+            in += 8;
+            if (step.firstId < nextStep || step.count <= 0 || step.count > nextId - step.firstId) {
+                return invalid("undo steps out of order.");
             }
-            shapeCommands.addShape(make_shared<Circle>(x, y, radius, fillOption, shapeColor));
-        } else if (shapeType == "triangle") {
-            int x1, y1, x2, y2, x3, y3;
-            string shapeColor, fillMode;
+            nextStep = step.firstId + step.count;
+        }
+        shapeCommands.restoreHistory(nextId, undoSteps);
+        return true;
+    }
 
-            if (!(iss >> x1 >> y1 >> x2 >> y2 >> x3 >> y3)) {
-                throw invalid_argument("Invalid number of arguments for Triangle. Expected 6.");
-            }
-            iss >> shapeColor;
-            iss >> fillMode;
-            fillMode = toLowerCase(fillMode);
-            if (fillMode == "fill") {
-                fillOption = FILL;
-            } else if (fillMode == "frame") {
-                fillOption = FRAME;
-            } else {
-                throw invalid_argument("Incorrect form! Use 'fill' or 'frame'");
-            }
-            if (iss >> extraArg) {
-                throw invalid_argument("Too many arguments for Triangle. Expected 6.");
-            }
-            shapeCommands.addShape(make_shared<Triangle>(x1, y1, x2, y2, x3, y3, fillOption, shapeColor));
-        } else if (shapeType == "line") {
-            int x1, y1, x2, y2;
-            string shapeColor;
+    // Files ending in .bbin are written in the binary format, anything else as text.
+    bool saveShapes(const string &filePath) {
+        return isBinaryScene(filePath) ? saveBinary(filePath) : saveText(filePath);
+    }
 
-            if (!(iss >> x1 >> y1 >> x2 >> y2)) {
-                throw invalid_argument("Invalid number of arguments for Line. Expected 4.");
-            }
-            iss >> shapeColor;
-            if (iss >> extraArg && extraArg != "none") {
-                throw invalid_argument("Too many arguments for Line. Expected 4.");
+
+    bool loadBoard(const string &filePath, int width = 0, int height = 0) {
+        if (confirmLoad) {
+            cout <<
+                    "Be careful! If there are any figures on the board, they will be cleared, even if an error occurs. Do you "
+                    << "want to continue?" << endl;
+            string answer;
+            getline(cin, answer);
+
+            if (answer != "yes") {
+                cout << "Cancel the command" << endl;
+                return false;
             }
-            shapeCommands.addShape(make_shared<Line>(x1, y1, x2, y2, false, shapeColor));
+        }
+
+        shapeCommands.clearShapes();
+        if (width > 0 && height > 0) {
+            shapeCommands.resizeBoard(width, height);
+        }
+        MappedFile file(filePath);
+        if (!file.isOpen()) {
+            cout << "Failed to open file for loading." << endl;
+            return false;
+        }
+
+        bool isValid = isBinaryScene(filePath) ? loadBinary(file.data(), file.size())
+                                               : loadText(file.data(), file.size());
+
+        if (!isValid) {
+            shapeCommands.clearShapes();
+            cout << "Failed to load shapes. Board cleared." << endl;
         } else {
-            throw invalid_argument("Unknown shape.");
+            cout << "Board loaded from " << filePath << endl;
         }
+        return isValid;
     }
 };
 
-class FileParser {
+// Write-ahead journal of the commands that change the scene, folded into a snapshot
+// now and then so replay stays short. For a path P it keeps:
+//   P.journal      a "<seq> <command>" line appended before each such command runs
+//   P.journal.old  the records being folded into the snapshot, until it is written
+//   P.snapshot     the scene as of some seq, written beside it and renamed over it
+// Reopening loads the snapshot and replays both journals past its seq, so a crash at
+// any point of a compaction loses nothing that was synced.
+class Journal {
 private:
-    ShapeParser shapeParser;
-    ShapeCommands &shapeCommands;
+    string path;
+    int descriptor = -1;
+    unsigned long long seq = 0;
+    size_t sinceSnapshot = 0;
+    size_t compactions = 0;
+    // Appends go straight to the file but are synced in groups: once SYNC_RECORDS are
+    // waiting, or by the flusher thread SYNC_INTERVAL after the first of them, so a
+    // record is durable within that time even if no command follows it. lock guards
+    // the descriptor and the unsynced count, which the flusher shares.
+    static const size_t SYNC_RECORDS = 64;
+    static constexpr chrono::milliseconds SYNC_INTERVAL{50};
+    size_t unsynced = 0;
+    chrono::steady_clock::time_point firstUnsynced;
+    mutex lock;
+    condition_variable flushWake;
+    thread flusher;
+    bool stopping = false;
+    // The journal is compacted once it holds this many records.
+    static const size_t COMPACT_RECORDS = 1 << 16;
+    // Writes the snapshot and drops the old journal; compactionError is only read
+    // once it is joined.
+    thread compaction;
+    atomic<bool> compacting{false};
+    string compactionError;
+
+    string directory() const {
+        size_t slash = path.rfind('/');
+        return slash == string::npos ? "." : slash == 0 ? "/" : path.substr(0, slash);
+    }
 
-public:
-    FileParser(ShapeCommands &sc) : shapeCommands(sc), shapeParser(sc) {
+    static bool writeAll(int fd, const char *data, size_t size) {
+        while (size > 0) {
+            ssize_t written = write(fd, data, size);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+        return true;
     }
 
-    void saveShapes(const string &filePath) {
-        ofstream file(filePath);
-        if (!file.is_open()) {
-            cout << "Failed to open file for saving." << endl;
-            return;
+    static void syncDirectory(const string &dir) {
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd >= 0) {
+            fsync(fd);
+            ::close(fd);
+        }
+    }
+
+    // Replaces P.snapshot with bytes so that a crash leaves either the old or the new one.
+    static string writeSnapshot(const string &path, const string &dir, const vector<char> &bytes) {
+        string temporary = path + ".snapshot.tmp";
+        int fd = ::open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return "cannot create " + temporary + ": " + strerror(errno);
+        }
+        bool written = writeAll(fd, bytes.data(), bytes.size()) && fsync(fd) == 0;
+        string error = written ? "" : "cannot write " + temporary + ": " + strerror(errno);
+        ::close(fd);
+        if (written && rename(temporary.c_str(), (path + ".snapshot").c_str()) != 0) {
+            error = "cannot replace " + path + ".snapshot: " + strerror(errno);
+        }
+        if (!error.empty()) {
+            unlink(temporary.c_str());
+            return error;
         }
-        for (const auto &shape: shapeCommands.getShapes()) {
-            int ID = shape.first;
-            shared_ptr<Shape> sh = shape.second;
-            string fillMode = "none";
+        syncDirectory(dir);
+        return "";
+    }
+
+    void syncLocked() {
+        if (descriptor >= 0 && unsynced > 0) {
+            fdatasync(descriptor);
+        }
+        unsynced = 0;
+    }
 
-            if (auto rectangle = dynamic_cast<Rectangle *>(sh.get())) {
-                fillMode = fillOptionType(rectangle->getFillOption());
-            } else if (auto circle = dynamic_cast<Circle *>(sh.get())) {
-                fillMode = fillOptionType(circle->getFillOption());
-            } else if (auto triangle = dynamic_cast<Triangle *>(sh.get())) {
-                fillMode = fillOptionType(triangle->getFillOption());
+    void flushLoop() {
+        unique_lock<mutex> guard(lock);
+        while (!stopping) {
+            if (unsynced == 0) {
+                flushWake.wait(guard);
+            } else if (flushWake.wait_until(guard, firstUnsynced + SYNC_INTERVAL) == cv_status::timeout) {
+                syncLocked();
             }
+        }
+    }
 
-            file << "ID: " << ID << " Type: " << sh->getType() << " " << sh->getParams()
-                    << " Color: " << sh->getColor() << " FillMode: " << fillMode << endl;
+    void finishCompaction() {
+        if (compaction.joinable()) {
+            compaction.join();
+        }
+        if (!compactionError.empty()) {
+            cout << "Journal compaction failed: " << compactionError << endl;
+            compactionError.clear();
         }
-        file.close();
     }
 
+public:
+    ~Journal() {
+        close();
+    }
 
-    void loadBoard(const string &filePath) {
-        cout <<
-                "Be careful! If there are any figures on the board, they will be cleared, even if an error occurs. Do you "
-                << "want to continue?" << endl;
-        string answer;
-        getline(cin, answer);
+    bool isOpen() const {
+        return descriptor >= 0;
+    }
 
-        if (answer != "yes") {
-            cout << "Cancel the command" << endl;
-            return;
+    const string &getPath() const {
+        return path;
+    }
+
+    unsigned long long getSeq() const {
+        return seq;
+    }
+
+    // Starts appending to P.journal after replay: lastSeq is the last record applied
+    // and validBytes the length of the journal's whole records, cutting off a torn one.
+    // records is how many of them the snapshot does not hold yet.
+    bool open(const string &journalPath, unsigned long long lastSeq, size_t validBytes, size_t records) {
+        close();
+        path = journalPath;
+        string file = path + ".journal";
+        descriptor = ::open(file.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (descriptor < 0 || ftruncate(descriptor, static_cast<off_t>(validBytes)) != 0) {
+            cout << "Cannot open journal " << file << ": " << strerror(errno) << endl;
+            close();
+            return false;
         }
+        seq = lastSeq;
+        sinceSnapshot = records;
+        unsynced = 0;
+        stopping = false;
+        flusher = thread([this] { flushLoop(); });
+        return true;
+    }
 
-        shapeCommands.clearShapes();
-        ifstream file(filePath);
-        if (!file.is_open()) {
-            cout << "Failed to open file for loading." << endl;
+    // Records command under the next seq. A failed write stops journaling.
+    void append(string_view command) {
+        if (!isOpen()) {
             return;
         }
+        string record = to_string(seq + 1);
+        record += ' ';
+        record += command;
+        record += '\n';
+        unique_lock<mutex> guard(lock);
+        if (!writeAll(descriptor, record.data(), record.size())) {
+            int error = errno;
+            guard.unlock();
+            cout << "Journal write failed, journaling stopped: " << strerror(error) << endl;
+            close();
+            return;
+        }
+        ++seq;
+        ++sinceSnapshot;
+        if (unsynced++ == 0) {
+            firstUnsynced = chrono::steady_clock::now();
+            flushWake.notify_one();
+        }
+        if (unsynced >= SYNC_RECORDS) {
+            syncLocked();
+        }
+    }
 
-        string line;
-        bool isValid = true;
-        while (getline(file, line)) {
-            istringstream iss(line);
-            string idText, typeText, shapeType, colorText, color, fillText, fillMode;
-            int id;
+    void sync() {
+        lock_guard<mutex> guard(lock);
+        syncLocked();
+    }
 
-            if (!(iss >> idText >> id >> typeText >> shapeType)) {
-                cout << "Invalid file format: " << line << endl;
-                isValid = false;
-                break;
-            }
-            string shapeParams;
-            if (shapeType == "Circle" || shapeType == "Rectangle" || shapeType == "Triangle" || shapeType == "Line") {
-                getline(iss, shapeParams, 'C');
-                iss.seekg(-1, ios_base::cur);
-            }
+    bool wantsCompaction() const {
+        return isOpen() && sinceSnapshot >= COMPACT_RECORDS && !compacting;
+    }
 
-            if (!(iss >> colorText >> color >> fillText >> fillMode)) {
-                cout << "Invalid file format: " << line << endl;
-                isValid = false;
-                break;
+    // Folds the journal into snapshot, the scene as of getSeq(). The journal is moved
+    // aside and a new one started here; the snapshot is written on a background thread
+    // unless wait is set. A P.journal.old left by a crashed compaction is never moved
+    // over: that snapshot is written in place, covering both journals.
+    void compact(vector<char> snapshot, bool wait) {
+        if (!isOpen()) {
+            return;
+        }
+        finishCompaction();
+        sync();
+        ++compactions;
+        sinceSnapshot = 0;
+        string file = path + ".journal";
+        string old = file + ".old";
+        if (access(old.c_str(), F_OK) == 0) {
+            compactionError = writeSnapshot(path, directory(), snapshot);
+            if (compactionError.empty()) {
+                unlink(old.c_str());
+                if (ftruncate(descriptor, 0) != 0 || fdatasync(descriptor) != 0) {
+                    compactionError = "cannot empty " + file + ": " + strerror(errno);
+                } else {
+                    syncDirectory(directory());
+                }
             }
-
-            try {
-                istringstream shapeCommand(shapeType + " " + shapeParams + " " + color + " " + fillMode);
-                shapeParser.parseAddShapes(shapeCommand);
-            } catch (const exception &e) {
-                cout << "Error: " << e.what() << endl;
-                isValid = false;
-                break;
+            finishCompaction();
+            return;
+        }
+        if (rename(file.c_str(), old.c_str()) != 0) {
+            cout << "Journal compaction failed: cannot move " << file << " aside: " << strerror(errno) << endl;
+            return;
+        }
+        {
+            lock_guard<mutex> guard(lock);
+            ::close(descriptor);
+            descriptor = ::open(file.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        }
+        if (descriptor < 0) {
+            cout << "Cannot reopen journal " << file << ", journaling stopped: " << strerror(errno) << endl;
+        }
+        syncDirectory(directory());
+        compacting = true;
+        compaction = thread([this, old, dir = directory(), bytes = std::move(snapshot)] {
+            compactionError = writeSnapshot(path, dir, bytes);
+            if (compactionError.empty()) {
+                unlink(old.c_str());
+                syncDirectory(dir);
             }
+            compacting = false;
+        });
+        if (wait) {
+            finishCompaction();
         }
+    }
 
-        if (!isValid) {
-            shapeCommands.clearShapes();
-            cout << "Failed to load shapes. Board cleared." << endl;
-        } else {
-            cout << "Board loaded from " << filePath << endl;
+    void close() {
+        finishCompaction();
+        if (flusher.joinable()) {
+            {
+                lock_guard<mutex> guard(lock);
+                stopping = true;
+            }
+            flushWake.notify_one();
+            flusher.join();
         }
+        if (isOpen()) {
+            sync();
+            ::close(descriptor);
+            descriptor = -1;
+        }
+    }
 
-        file.close();
+    void printStats() const {
+        if (isOpen()) {
+            cout << "Journal " << path << ": seq " << seq << ", " << sinceSnapshot << " records since the snapshot, "
+                    << compactions << " compactions" << (compacting ? " (one running)" : "") << endl;
+        }
     }
 };
 
+enum CommandResult { COMMAND_OK, COMMAND_FAILED, COMMAND_STOP };
+
 class CommandsExecution {
 private:
-    Board board;
     ShapeCommands shapeCommands;
     ShapeParser shapeParser;
     FileParser fileParser;
+    Journal journal;
+    // The selection the journal last recorded a select for.
+    ShapeHandle journaledSelection;
+
+    // Journals a command that changes the scene before it runs. A command on the
+    // selection is preceded by a select of its ID, since a selection made by coordinates,
+    // or before the journal was opened, would not replay the same; with nothing
+    // selected it changes nothing and is left out.
+    void journalCommand(Keyword command, string_view input) {
+        switch (command) {
+            case Keyword::ADD:
+            case Keyword::UNDO:
+            case Keyword::CLEAR:
+                break;
+            case Keyword::MOVE:
+            case Keyword::EDIT:
+            case Keyword::PAINT:
+            case Keyword::REMOVE: {
+                ShapeHandle selection = shapeCommands.getSelection();
+                if (selection.id == 0) {
+                    return;
+                }
+                if (selection.id != journaledSelection.id || selection.generation != journaledSelection.generation) {
+                    journal.append("select " + to_string(selection.id));
+                    journaledSelection = selection;
+                }
+                break;
+            }
+            default:
+                return;
+        }
+        journal.append(input);
+    }
 
-public:
-    CommandsExecution()
-        : shapeParser(shapeCommands), fileParser(shapeCommands) {
+    // The snapshot does not keep the selection, so the next command on it must journal
+    // its select again.
+    void compactJournal(bool wait) {
+        journal.compact(fileParser.encodeSnapshot(journal.getSeq()), wait);
+        journaledSelection = ShapeHandle();
     }
 
-    void inputReader() {
-        string input;
+    // Runs the whole records of a journal file with output muted, skipping those up to
+    // seq, which is left at the last one run. Records that fail, or adds that add no
+    // shape, are counted in failed. Returns how far the whole records go; a torn or
+    // garbled record and everything after it are dropped.
+    size_t replayJournal(const string &filePath, unsigned long long &seq, size_t &replayed, size_t &failed) {
+        MappedFile file(filePath);
+        const char *data = file.data();
+        const char *end = data + file.size();
+        const char *next = data;
+        streambuf *output = cout.rdbuf(nullptr);
+        while (next < end) {
+            const char *newline = static_cast<const char *>(memchr(next, '\n', end - next));
+            if (!newline) {
+                break;
+            }
+            unsigned long long recordSeq;
+            auto [command, error] = from_chars(next, newline, recordSeq);
+            if (error != errc() || command == newline || *command != ' ') {
+                break;
+            }
+            if (recordSeq > seq) {
+                string_view record(command + 1, newline - command - 1);
+                int nextId = shapeCommands.getNextId();
+                if (executeCommand(record) == COMMAND_FAILED ||
+                    (keywordOf(Tokenizer(record).next()) == Keyword::ADD && shapeCommands.getNextId() == nextId)) {
+                    ++failed;
+                }
+                seq = recordSeq;
+                ++replayed;
+            }
+            next = newline + 1;
+        }
+        cout.rdbuf(output);
+        if (next < end) {
+            cout << "Journal " << filePath << " ends in a damaged record at byte " << next - data << "; it is dropped."
+                    << endl;
+        }
+        return static_cast<size_t>(next - data);
+    }
 
-        while (true) {
-            cout << "Enter a command: ";
-            getline(cin, input);
-            string command;
-            istringstream iss(input);
-            iss >> command;
+public:
+    CommandsExecution(int width, int height)
+        : shapeCommands(width, height), shapeParser(shapeCommands), fileParser(shapeCommands) {
+    }
 
-            try {
-                if (command == "draw") {
+    // Runs one command line, reporting any problem on cout. Commands that only print
+    // why they did nothing, like adding a duplicate, still count as run.
+    CommandResult executeCommand(string_view input) {
+        Tokenizer tokens(input);
+        string_view command = tokens.next();
+        Keyword keyword = keywordOf(command);
+        if (journal.isOpen()) {
+            if (journal.wantsCompaction()) {
+                compactJournal(false);
+            }
+            journalCommand(keyword, input);
+        }
+
+        try {
+            switch (keyword) {
+                case Keyword::DRAW:
                     shapeCommands.drawBoard();
-                } else if (command == "list") {
+                    break;
+                case Keyword::LIST:
                     shapeCommands.listShapes();
-                } else if (command == "shapes") {
+                    break;
+                case Keyword::SHAPES:
                     shapeCommands.allShapes();
-                } else if (command == "add") {
-                    shapeParser.parseAddShapes(iss);
-                } else if (command == "undo") {
+                    break;
+                case Keyword::ADD:
+                    shapeParser.parseAddShapes(tokens);
+                    break;
+                case Keyword::UNDO:
                     shapeCommands.undoShape();
-                } else if (command == "clear") {
+                    break;
+                case Keyword::CLEAR:
                     shapeCommands.clearShapes();
-                } else if (command == "save") {
-                    string filePath;
-                    iss >> filePath;
-                    fileParser.saveShapes(filePath);
-                } else if (command == "load") {
-                    string filePath;
-                    iss >> filePath;
-                    fileParser.loadBoard(filePath);
-                } else if (command == "select") {
+                    break;
+                case Keyword::SAVE:
+                    if (!fileParser.saveShapes(string(tokens.next()))) {
+                        return COMMAND_FAILED;
+                    }
+                    break;
+                case Keyword::LOAD: {
+                    string filePath(tokens.next());
+                    int width = 0, height = 0;
+                    if (tokens.next(width) && !tokens.next(height)) {
+                        throw invalid_argument("Provide both width and height for the board.");
+                    }
+                    bool loaded = fileParser.loadBoard(filePath, width, height);
+                    // A load cannot be replayed from the journal, so the scene it leaves
+                    // becomes the snapshot before anything is journaled after it.
+                    if (journal.isOpen()) {
+                        compactJournal(true);
+                    }
+                    if (!loaded) {
+                        return COMMAND_FAILED;
+                    }
+                    break;
+                }
+                case Keyword::SELECT: {
                     int idOrX, y;
-                    if (iss >> idOrX) {
-                        if (iss >> y) {
-                            shapeCommands.selectByCoordinates(idOrX, y);
-                        } else {
-                            shapeCommands.selectByID(idOrX);
-                        }
-                    } else {
+                    if (!tokens.next(idOrX)) {
                         cout << "Invalid input for select command." << endl;
+                        return COMMAND_FAILED;
+                    }
+                    if (tokens.next(y)) {
+                        shapeCommands.selectByCoordinates(idOrX, y);
+                    } else {
+                        shapeCommands.selectByID(idOrX);
                     }
-                } else if (command == "remove") {
+                    break;
+                }
+                case Keyword::REMOVE:
                     shapeCommands.remove();
-                } else if (command == "paint") {
-                    string color;
-                    iss >> color;
-                    shapeCommands.paint(color);
-                } else if (command == "move") {
-                    int x, y;
-                    iss >> x >> y;
+                    break;
+                case Keyword::PAINT:
+                    shapeCommands.paint(tokens.next());
+                    break;
+                case Keyword::BENCH: {
+                    int count, threads = max(1, static_cast<int>(thread::hardware_concurrency()));
+                    if (!tokens.next(count)) {
+                        throw invalid_argument("Usage: bench <shape count> [max threads] [skewed]");
+                    }
+                    tokens.next(threads);
+                    string_view scene = tokens.next();
+                    if (!scene.empty() && scene != "skewed") {
+                        throw invalid_argument("Usage: bench <shape count> [max threads] [skewed]");
+                    }
+                    shapeCommands.benchmark(count, threads, scene == "skewed");
+                    break;
+                }
+                case Keyword::THREADS: {
+                    int threads;
+                    if (!tokens.next(threads)) {
+                        throw invalid_argument("Usage: threads <count>");
+                    }
+                    shapeCommands.setThreads(threads);
+                    cout << "Drawing with " << threads << (threads == 1 ? " thread." : " threads.") << endl;
+                    break;
+                }
+                case Keyword::STATS:
+                    shapeCommands.printStats();
+                    journal.printStats();
+                    break;
+                case Keyword::PICK: {
+                    string_view mode = tokens.next();
+                    if (mode == "on") {
+                        shapeCommands.setPicking(true);
+                    } else if (mode == "off") {
+                        shapeCommands.setPicking(false);
+                    } else {
+                        cout << "Use 'pick on' or 'pick off'." << endl;
+                        return COMMAND_FAILED;
+                    }
+                    break;
+                }
+                case Keyword::MOVE: {
+                    int x = 0, y = 0;
+                    if (tokens.next(x)) {
+                        tokens.next(y);
+                    }
                     shapeCommands.move(x, y);
-                } else if (command == "edit") {
-                    shapeCommands.edit(iss);
-                } else if (command == "stop") {
                     break;
-                } else {
-                    cout << "Unknown command: " << command << endl;
                 }
-            } catch (const invalid_argument &e) {
-                cout << "Error: " << e.what() << endl;
-            } catch (const exception &e) {
-                cout << "Unexpected error: " << e.what() << endl;
+                case Keyword::EDIT:
+                    shapeCommands.edit(tokens);
+                    break;
+                case Keyword::STOP:
+                    return COMMAND_STOP;
+                default:
+                    cout << "Unknown command: " << command << endl;
+                    return COMMAND_FAILED;
+            }
+        } catch (const invalid_argument &e) {
+            cout << "Error: " << e.what() << endl;
+            return COMMAND_FAILED;
+        } catch (const exception &e) {
+            cout << "Unexpected error: " << e.what() << endl;
+            return COMMAND_FAILED;
+        }
+        return COMMAND_OK;
+    }
+
+    // Restores the scene kept at path (its snapshot, then both journals) and journals
+    // every change from here on. Returns false if the snapshot is unreadable or the
+    // journal cannot be opened. A scene with no snapshot yet gets one straight away, so
+    // its board size is kept for the records that follow.
+    bool openJournal(const string &path) {
+        unsigned long long seq = 0;
+        bool snapshotFound;
+        {
+            MappedFile snapshot(path + ".snapshot");
+            snapshotFound = snapshot.isOpen();
+            if (snapshotFound && !fileParser.loadSnapshot(snapshot.data(), snapshot.size(), seq)) {
+                return false;
+            }
+        }
+        size_t restored = shapeCommands.getShapes().size();
+        size_t replayed = 0;
+        size_t failed = 0;
+        string old = path + ".journal.old";
+        bool crashedCompaction = access(old.c_str(), F_OK) == 0;
+        if (crashedCompaction) {
+            replayJournal(old, seq, replayed, failed);
+        }
+        size_t replayedOld = replayed;
+        size_t validBytes = replayJournal(path + ".journal", seq, replayed, failed);
+        if (!journal.open(path, seq, validBytes, replayed - replayedOld)) {
+            return false;
+        }
+        if (crashedCompaction || !snapshotFound) {
+            compactJournal(true);
+        }
+        cout << "Journal " << path << ": restored " << restored << " shapes and replayed " << replayed
+                << " commands";
+        if (failed > 0) {
+            cout << ", " << failed << " of them failed";
+        }
+        cout << "." << endl;
+        return true;
+    }
+
+    void inputReader() {
+        string input;
+
+        while (true) {
+            cout << "Enter a command: ";
+            if (!getline(cin, input) || executeCommand(input) == COMMAND_STOP) {
+                break;
+            }
+        }
+    }
+
+    // Runs a script (stdin for "-") line by line with no prompts and no confirmations,
+    // then reports throughput on cerr. Returns the exit code: 0 when every command ran,
+    // 1 when any failed, 2 when the script cannot be opened.
+    int runBatch(const string &scriptPath) {
+        ifstream file;
+        istream *script = &cin;
+        if (scriptPath != "-") {
+            file.open(scriptPath);
+            if (!file.is_open()) {
+                cerr << "Failed to open script " << scriptPath << endl;
+                return 2;
+            }
+            script = &file;
+        }
+        fileParser.setConfirmLoad(false);
+        shapeCommands.setDifferential(false);
+
+        long long commands = 0, failures = 0;
+        auto start = chrono::steady_clock::now();
+        string input;
+        while (getline(*script, input)) {
+            if (input.empty()) {
+                continue;
+            }
+            ++commands;
+            CommandResult result = executeCommand(input);
+            if (result == COMMAND_STOP) {
+                break;
+            }
+            if (result == COMMAND_FAILED) {
+                ++failures;
             }
         }
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        cout.flush();
+        cerr << "Ran " << commands << " commands in " << seconds << " s ("
+                << static_cast<long long>(commands / max(seconds, 1e-9)) << " commands/s), " << failures << " failed"
+                << endl;
+        return failures == 0 ? 0 : 1;
     }
 };
 
-int main() {
-    CommandsExecution execution;
+// Tests include this file with SHAPES_NO_MAIN defined to reach the classes above.
+#ifndef SHAPES_NO_MAIN
+int main(int argc, char *argv[]) {
+    int width = DEFAULT_BOARD_WIDTH;
+    int height = DEFAULT_BOARD_HEIGHT;
+    int arg = 1;
+    string script, journal;
+    const string usage = string("Usage: ") + argv[0] + " [--batch <script|->] [--journal <path>] [width height]";
+    while (arg < argc && (string(argv[arg]) == "--batch" || string(argv[arg]) == "--journal")) {
+        if (arg + 1 == argc) {
+            cout << usage << endl;
+            return 1;
+        }
+        (string(argv[arg]) == "--batch" ? script : journal) = argv[arg + 1];
+        arg += 2;
+    }
+    if (argc - arg == 2) {
+        width = atoi(argv[arg]);
+        height = atoi(argv[arg + 1]);
+    } else if (argc != arg) {
+        cout << usage << endl;
+        return 1;
+    }
+    if (width <= 0 || height <= 0) {
+        cout << "Board size must be positive." << endl;
+        return 1;
+    }
+    CommandsExecution execution(width, height);
+    if (!journal.empty() && !execution.openJournal(journal)) {
+        return 2;
+    }
+    if (!script.empty()) {
+        return execution.runBatch(script);
+    }
     execution.inputReader();
     return 0;
 }
+#endif
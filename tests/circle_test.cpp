@@ -0,0 +1,179 @@
+// Checks the circle rasterizer cell for cell against the original one, which tested
+// every board cell with sqrt(pow(...)), both drawn on its own and through the full
+// renderer (raster cache, dirty regions, tiles and threads).
+#include <fcntl.h>
+#include <random>
+#include <unistd.h>
+#define SHAPES_NO_MAIN
+#include "../main.cpp"
+
+namespace {
+
+const char *const COLOR_NAMES[] = {"red", "green", "yellow", "blue", "magenta", "cyan", "white"};
+
+struct Case {
+    int x, y, radius;
+    FillOption fill;
+    const char *color;
+};
+
+// The rasterizer Circle::draw replaced, kept as the reference. Each colour draws with
+// its initial in upper case.
+void referenceCircle(vector<char> &grid, int width, int height, const Case &circle) {
+    char symbol = static_cast<char>(toupper(circle.color[0]));
+    for (int i = 0; i < width; ++i) {
+        for (int j = 0; j < height; ++j) {
+            double distance = sqrt(pow(i - circle.x, 2) + pow((j - circle.y) * 2, 2));
+            if (circle.fill == FRAME) {
+                if (fabs(distance - circle.radius) < 0.5) {
+                    grid[static_cast<size_t>(j) * width + i] = symbol;
+                }
+            } else if (circle.fill == FILL) {
+                if (distance <= circle.radius) {
+                    grid[static_cast<size_t>(j) * width + i] = symbol;
+                }
+            }
+        }
+    }
+}
+
+Circle makeCircle(const Case &circle) {
+    return Circle(circle.x, circle.y, circle.radius, circle.fill, circle.color);
+}
+
+// Reports the first cell where board differs from expected.
+bool sameCells(const Board &board, const vector<char> &expected, const string &what) {
+    for (int y = 0; y < board.height; ++y) {
+        for (int x = 0; x < board.width; ++x) {
+            char got = board.cells[static_cast<size_t>(y) * board.stride + x];
+            char want = expected[static_cast<size_t>(y) * board.width + x];
+            if (got != want) {
+                cerr << what << ": cell (" << x << ", " << y << ") is '" << got << "', expected '" << want << "'"
+                        << endl;
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// Runs f with cout and the terminal output of drawBoard thrown away.
+template<typename F>
+void quietly(F f) {
+    cout.flush();
+    int saved = dup(STDOUT_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    streambuf *output = cout.rdbuf(nullptr);
+    f();
+    cout.rdbuf(output);
+    dup2(saved, STDOUT_FILENO);
+    close(null);
+    close(saved);
+}
+
+Case randomCase(mt19937 &random, int width, int height) {
+    auto between = [&random](int low, int high) { return uniform_int_distribution<int>(low, high)(random); };
+    int radius = between(0, 3) == 0 ? between(0, max(width, height)) : between(0, 12);
+    return {between(-20, width + 20), between(-20, height + 20), radius, between(0, 1) ? FILL : FRAME,
+            COLOR_NAMES[between(0, 6)]};
+}
+
+bool testSingleCircles() {
+    mt19937 random(2);
+    const int sizes[][2] = {{80, 25}, {1, 1}, {7, 300}, {333, 41}};
+    for (const auto &size: sizes) {
+        int width = size[0], height = size[1];
+        Board board(width, height);
+        for (int i = 0; i < 1000; ++i) {
+            Case circle = randomCase(random, width, height);
+            board.clear();
+            Canvas canvas = board.canvas(board.bounds());
+            makeCircle(circle).draw(canvas);
+            vector<char> expected(static_cast<size_t>(width) * height, ' ');
+            referenceCircle(expected, width, height, circle);
+            if (!sameCells(board, expected, "circle " + makeCircle(circle).getParams() + " on " +
+                                            to_string(width) + "x" + to_string(height))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// The board accepts circles by the original rule, which bounds the rows by the radius
+// and not by the aspect-corrected half height.
+bool testValidBorder() {
+    Board board(80, 25);
+    const Case accepted[] = {{56, 29, 8, FILL, "red"}, {40, -8, 8, FRAME, "red"}, {-12, 0, 12, FILL, "red"}};
+    const Case rejected[] = {{56, 34, 8, FILL, "red"}, {40, 12, 13, FILL, "red"}, {92, 12, 12, FRAME, "red"}};
+    for (const Case &circle: accepted) {
+        if (!makeCircle(circle).validBorder(board)) {
+            cerr << "circle " << makeCircle(circle).getParams() << " was rejected" << endl;
+            return false;
+        }
+    }
+    for (const Case &circle: rejected) {
+        if (makeCircle(circle).validBorder(board)) {
+            cerr << "circle " << makeCircle(circle).getParams() << " was accepted" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Draws a scene, moves and repaints some of it, and redraws, on one and on four threads.
+bool testScene(int threads) {
+    const int width = 520, height = 270;
+    mt19937 random(3);
+    ShapeCommands scene(width, height);
+    scene.setThreads(threads);
+    vector<Case> cases;
+    while (cases.size() < 250) {
+        Case circle = randomCase(random, width, height);
+        circle.radius = min(circle.radius, height / 2);
+        AnyShape shape = makeCircle(circle);
+        if (shape.validBorder(scene.getBoard())) {
+            size_t before = scene.getShapes().size();
+            quietly([&] { scene.addShape(std::move(shape)); });
+            if (scene.getShapes().size() > before) {
+                cases.push_back(circle);
+            }
+        }
+    }
+    for (int round = 0; round < 3; ++round) {
+        quietly([&] { scene.drawBoard(); });
+        vector<char> expected(static_cast<size_t>(width) * height, ' ');
+        for (const Case &circle: cases) {
+            referenceCircle(expected, width, height, circle);
+        }
+        if (!sameCells(scene.getBoard(), expected, "scene on " + to_string(threads) + " threads, round " +
+                                                    to_string(round))) {
+            return false;
+        }
+        for (int change = 0; change < 20; ++change) {
+            size_t index = uniform_int_distribution<size_t>(0, cases.size() - 1)(random);
+            Case &circle = cases[index];
+            Case moved = circle;
+            moved.x = uniform_int_distribution<int>(0, width - 1)(random);
+            moved.y = uniform_int_distribution<int>(0, height - 1)(random);
+            moved.color = COLOR_NAMES[uniform_int_distribution<int>(0, 6)(random)];
+            quietly([&] {
+                scene.selectByID(static_cast<int>(index) + 1);
+                scene.move(moved.x, moved.y);
+                scene.paint(moved.color);
+            });
+            circle = moved;
+        }
+    }
+    return true;
+}
+
+}
+
+int main() {
+    bool passed = testSingleCircles() && testValidBorder() && testScene(1) && testScene(4);
+    cout << (passed ? "Circle rasterizer matches the reference." : "Circle rasterizer differs from the reference.")
+            << endl;
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,116 @@
+// Checks that a journaled scene reopens as it was left, across a compaction that
+// happens while a shape stays selected, and on a board of another startup size.
+#define SHAPES_NO_MAIN
+#include "../main.cpp"
+
+namespace {
+
+// Runs f with cout thrown away.
+template<typename F>
+void quietly(F f) {
+    streambuf *output = cout.rdbuf(nullptr);
+    f();
+    cout.rdbuf(output);
+}
+
+string readFile(const string &filePath) {
+    ifstream file(filePath);
+    return string(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+}
+
+// Saves the scene of execution as text and returns it.
+string savedScene(CommandsExecution &execution, const string &filePath) {
+    quietly([&] { execution.executeCommand("save " + filePath); });
+    return readFile(filePath);
+}
+
+bool check(bool condition, const string &what) {
+    if (!condition) {
+        cerr << what << endl;
+    }
+    return condition;
+}
+
+void removeScene(const string &path) {
+    for (const char *suffix: {".journal", ".journal.old", ".snapshot", ".before.txt", ".after.txt"}) {
+        unlink((path + suffix).c_str());
+    }
+}
+
+// Reopens the journal at path on a width x height board and compares its scene with before.
+bool reopensAs(const string &path, int width, int height, const string &before) {
+    CommandsExecution execution(width, height);
+    bool opened = false;
+    quietly([&] { opened = execution.openJournal(path); });
+    string after = savedScene(execution, path + ".after.txt");
+    return check(opened, "Cannot reopen the journal.") &&
+           check(before == after, "Reopened scene:\n" + after + "differs from:\n" + before);
+}
+
+bool testCompaction(const string &path) {
+    const char *colors[] = {"red", "blue", "green"};
+    string before;
+    {
+        CommandsExecution execution(80, 25);
+        bool opened = false;
+        quietly([&] {
+            opened = execution.openJournal(path);
+            execution.executeCommand("add rectangle 1 1 3 3 red fill");
+            execution.executeCommand("add circle 40 12 4 cyan frame");
+            execution.executeCommand("select 1");
+            // Enough commands on the selection for a compaction to happen among them.
+            for (int i = 0; i < 70000; ++i) {
+                execution.executeCommand(string("paint ") + colors[i % 3]);
+            }
+            execution.executeCommand("move 30 10");
+            execution.executeCommand("select 2");
+            execution.executeCommand("edit 5");
+        });
+        before = savedScene(execution, path + ".before.txt");
+        if (!check(opened, "Cannot open the journal.") ||
+            !check(before.find("Rectangle 30 10 3 3") != string::npos, "The rectangle was not moved.")) {
+            return false;
+        }
+    }
+    return reopensAs(path, 80, 25, before);
+}
+
+// Shapes that only fit the board the journal was started on survive a reopen on a
+// smaller one.
+bool testBoardSize(const string &path) {
+    string before;
+    {
+        CommandsExecution execution(4000, 4000);
+        bool opened = false;
+        quietly([&] {
+            opened = execution.openJournal(path);
+            execution.executeCommand("add circle 3000 3000 50 red fill");
+            execution.executeCommand("add circle 100 100 10 blue frame");
+        });
+        before = savedScene(execution, path + ".before.txt");
+        if (!check(opened, "Cannot open the journal.") ||
+            !check(before.find("Circle 3000 3000 50") != string::npos, "The far circle was not added.")) {
+            return false;
+        }
+    }
+    return reopensAs(path, 80, 25, before);
+}
+
+}
+
+int main() {
+    char directory[] = "/tmp/journal_test_XXXXXX";
+    if (!mkdtemp(directory)) {
+        cerr << "Cannot create a temporary directory." << endl;
+        return 1;
+    }
+    string compacted = string(directory) + "/compacted";
+    string resized = string(directory) + "/resized";
+    bool passed = testCompaction(compacted) && testBoardSize(resized);
+
+    removeScene(compacted);
+    removeScene(resized);
+    rmdir(directory);
+    cout << (passed ? "Journal replays to the same scene." : "Journal replays to a different scene.") << endl;
+    return passed ? 0 : 1;
+}